@@ -0,0 +1,453 @@
+/* Andre Braga Reis, 2016
+ */
+
+#ifndef DATASET_H_
+#define DATASET_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cfloat>
+#include <cstring>
+
+#include <sys/types.h>
+
+#include "neatRSU.h"
+
+using namespace std;
+
+
+/* Definitions
+   ----------- */
+
+/* Binary dataset cache (.nrsu).
+ * A header, a table of sections, and the sections themselves. Each section holds one typed
+ * column of the sorted database and starts on a 64-byte boundary, so a mapped cache can be
+ * read in place. The header records the size, modification time and checksum of the source CSV.
+ */
+#define DATASET_CACHE_MAGIC 	"NRSU"
+#define DATASET_CACHE_VERSION 	1
+#define DATASET_CACHE_ALIGN 	64
+
+enum CacheSectionId {
+	SECTION_NODE_ID = 1, SECTION_RELATIVE_TIME, SECTION_LATITUDE, SECTION_LONGITUDE,
+	SECTION_SPEED, SECTION_HEADING, SECTION_CONTACT_TIME,
+	// Only in published datasets: the feature matrix, and the schema (as text) it was computed with.
+	SECTION_FEATURES, SECTION_SCHEMA };
+
+struct CacheHeader
+{
+	char		magic[4];
+	uint32_t	version;
+	uint64_t	entries;
+	uint64_t	sourceSize;
+	int64_t		sourceMtime;
+	uint64_t	sourceChecksum;
+	uint32_t	sectionCount;
+	uint32_t	headerBytes;
+};
+
+struct CacheSection
+{
+	uint32_t	id;
+	uint32_t	elementSize;
+	uint64_t	offset;
+	uint64_t	bytes;
+};
+
+/* Input schema.
+ * A comma-separated list of columns, each optionally followed by transforms, e.g.
+ * "node_id,relative_time:delta,latitude:zscore,speed:scale=0.1". The default feeds the six
+ * raw columns, as the network always had.
+ */
+#define DATASET_DEFAULT_SCHEMA	"node_id,relative_time,latitude,longitude,speed,heading"
+#define DATASET_MAX_FEATURES	64
+
+enum class FeatureScaling { NONE, SCALE, ZSCORE, MINMAX };
+
+// Summary of a database load, for reporting.
+struct DatabaseLoadStats
+{
+	uint64_t	bytes = 0;
+	double		seconds = 0;
+	bool		fromCache = false;
+	bool		cacheWritten = false;
+};
+
+
+// The entries of one vehicle (one trip of it, if split at the trip gap) in a sorted database: [begin,end).
+struct DatasetSegment
+{
+	uint64_t	begin;
+	uint64_t	end;
+	uint16_t	node_id;
+	uint64_t	encodedOffset;	// Where the segment starts in Dataset::encoded
+};
+
+
+// Tolerances for merging redundant consecutive samples of a vehicle, by CacheSectionId.
+// A negative tolerance leaves the column out of the comparison. contact_time, the target, is never compared.
+class CompactionTolerances
+{
+public:
+	double tolerance[SECTION_HEADING+1];
+
+	// By default, samples merge only if their position, speed and heading are unchanged. relative_time
+	// changes on every sample, so it is left out.
+	CompactionTolerances();
+
+	// Parse a list such as "latitude=1e-5,longitude=1e-5,speed=1,relative_time=30". Exits if malformed.
+	void Parse(string text);
+};
+
+
+// A database in columnar (structure-of-arrays) form: one contiguous array per field, each
+// aligned to DATASET_CACHE_ALIGN bytes. The columns are either allocated by the dataset, or
+// point straight into a mapped .nrsu cache, in which case they are read-only.
+class Dataset
+{
+public:
+	// Number of entries
+	uint64_t	size = 0;
+
+	// Columns
+	uint16_t*	node_id = 0;
+	uint32_t*	relative_time = 0;
+	float*		latitude = 0;
+	float*		longitude = 0;
+	uint16_t*	speed = 0;
+	uint16_t*	heading = 0;
+	uint32_t*	contact_time = 0;
+
+	// One segment per vehicle, in database order. Rebuilt whenever the entries change.
+	vector<DatasetSegment> segments;
+
+	// Input features, a row of 'featureCount' floats per entry. Computed by FeatureSchema::Apply(),
+	// or mapped from a published dataset.
+	const float*	features = 0;
+	uint16_t		featureCount = 0;
+
+	/* How many samples each entry stands for, once Compact()ed or Decimate()d. Null if every entry counts once.
+	 * With them, the mean contact_time of those samples and the sum of their squared differences to it:
+	 * weight*(prediction-mean)^2 + spread is then exactly the error of the samples for a shared prediction.
+	 */
+	const uint32_t*	weights = 0;
+	const double*	targetMeans = 0;
+	const double*	targetSpreads = 0;
+
+	/* Compressed features and targets, once Encode()d. Each segment is stored row by row: every
+	 * feature (as its float bits), then contact_time (and the weight, target mean and spread, if any,
+	 * the doubles as two words each), as the zigzag varint of its difference to the previous row. 
+	 * Decode with a SegmentDecoder.
+	 */
+	vector<uint8_t>	encoded;
+	bool			isEncoded = false;
+	bool			isEncodedWeighted = false;	// The weight and targets follow contact_time on every row
+
+	Dataset(){};
+	~Dataset();
+
+	// A dataset owns its columns, so it cannot be copied.
+	Dataset(const Dataset&) = delete;
+	Dataset& operator=(const Dataset&) = delete;
+
+	// Allocate (uninitialized) columns for 'entries' entries. Reuses the current storage if it is large enough.
+	void Allocate(uint64_t entries);
+
+	// Copy a vector of entries into the columns.
+	void Assign(const vector<DataEntry>& entries);
+
+	// Use the columns of a mapped cache in place, from their offsets (by CacheSectionId) in the mapping.
+	// The dataset takes over the mapping and unmaps it when released.
+	void AssignMapping(void* mapping, uint64_t mappingBytes, uint64_t entries, const uint64_t* columnOffsets);
+
+	// Free the columns.
+	void Release(void);
+
+	// Allocate (uninitialized) room for 'count' features per entry, and return it for writing.
+	float* AllocateFeatures(uint16_t count);
+
+	// The column for a CacheSectionId.
+	void* Column(uint32_t section) const;
+
+	// Rebuild 'segments' from the node_id column, splitting trips at the trip gap. The database must be sorted by nodeID.
+	void IndexSegments(void);
+
+	/* Merge every run of consecutive samples of a vehicle that stay within 'tolerances' of the run's
+	 * first sample into that sample, weighted by the length of the run and scored against all its 
+	 * targets. Needs the features computed. Returns the number of entries removed.
+	 */
+	uint64_t Compact(const CompactionTolerances& tolerances);
+
+	// Fill with every factor-th sample of each vehicle of 'source', weighted by (and scored against) the samples it skips.
+	// 'source' needs its features computed, and must not be encoded.
+	void Decimate(const Dataset* source, uint32_t factor);
+
+	// Compress the features and targets into 'encoded', and free the columns and the feature matrix.
+	// Only the segments, 'size' and 'featureCount' are kept alongside.
+	void Encode(void);
+
+private:
+	void*		storage = 0;
+	uint64_t	storageBytes = 0;
+	bool		mapped = false;
+	vector<float> featureStorage;
+	vector<uint32_t> weightStorage;
+	vector<double> targetMeanStorage;
+	vector<double> targetSpreadStorage;
+
+	void FreeStorage(void);
+
+	// Drop the weights and target statistics.
+	void FreeWeights(void);
+
+	// Fill with the given 'rows' of 'source', carrying the weights, target means and spreads of each (which are taken).
+	void Gather(const Dataset* source, const vector<uint64_t>& rows, 
+		vector<uint32_t>* rowWeights, vector<double>* rowMeans, vector<double>* rowSpreads);
+
+	// Exchange contents with another dataset.
+	void Swap(Dataset* other);
+};
+
+
+// Decodes one segment of an encoded dataset, a row at a time.
+class SegmentDecoder
+{
+public:
+	SegmentDecoder() {}
+	SegmentDecoder(const Dataset* data, const DatasetSegment& segment)
+	{
+		p = data->encoded.data() + segment.encodedOffset;
+		featureCount = data->featureCount;
+		valueCount = featureCount + (data->isEncodedWeighted ? 6 : 1);
+		memset(previous, 0, sizeof(previous));
+		previous[featureCount+1] = 1;
+	}
+
+	// Decode the next row: its features go to 'features', and its contact_time is returned.
+	inline uint32_t Next(float* features)
+	{
+		for(uint16_t f = 0; f < valueCount; f++)
+		{
+			uint32_t zigzag = 0, shift = 0, byte;
+			do { byte = *p++; zigzag |= (byte & 0x7F) << shift; shift += 7; } while(byte & 0x80);
+			previous[f] += (zigzag >> 1) ^ (0 - (zigzag & 1));
+		}
+		memcpy(features, previous, featureCount*sizeof(float));
+		return previous[featureCount];
+	}
+
+	// The weight of the row last decoded, the mean of its targets and their spread (see Dataset::weights).
+	inline uint32_t Weight(void) const { return previous[featureCount+1]; }
+	inline double TargetMean(void) const 
+		{ return (valueCount > featureCount+1) ? Word(featureCount+2) : previous[featureCount]; }
+	inline double TargetSpread(void) const 
+		{ return (valueCount > featureCount+1) ? Word(featureCount+4) : 0; }
+
+private:
+	const uint8_t*	p;
+	uint16_t		featureCount;
+	uint16_t		valueCount;
+	uint32_t		previous[DATASET_MAX_FEATURES+6];
+
+	// The double stored in words 'f' and 'f'+1.
+	inline double Word(uint16_t f) const { double value; memcpy(&value, &previous[f], sizeof(value)); return value; }
+};
+
+
+// A random subset of the segments of a dataset, for evaluating on part of the data.
+struct DatasetSample
+{
+	vector<DatasetSegment> segments;
+	uint64_t	entries = 0;	// Entries in the sampled segments
+};
+
+
+// One input feature: a column of the database, optionally differenced within each vehicle,
+// then scaled as feature = (value - offset) * scale.
+struct FeatureSpec
+{
+	string			name;
+	uint32_t		column = SECTION_NODE_ID;	// CacheSectionId
+	bool			delta = false;				// Difference to the previous entry of the same vehicle, 0 on its first
+	FeatureScaling	scaling = FeatureScaling::NONE;
+	double			offset = 0;
+	double			scale = 1;
+
+	// Statistics for ZSCORE and MINMAX, gathered from the training data
+	uint64_t		count = 0;
+	double			sum = 0, sumSquares = 0, minimum = DBL_MAX, maximum = -DBL_MAX;
+};
+
+
+class DatabaseStream;
+
+// The features fed to the network's sensor nodes, in order.
+class FeatureSchema
+{
+public:
+	vector<FeatureSpec> features;
+
+	// Parse a schema (see DATASET_DEFAULT_SCHEMA). Each column may be followed by any of
+	// ':delta', ':zscore', ':minmax', ':scale=<factor>', ':offset=<value>' and ':as=<name>'.
+	// Exits on a malformed schema.
+	void Parse(string text);
+
+	// The schema as text, with its fitted scalings written out as constants.
+	string ToString(void) const;
+
+	// Fit the ZSCORE and MINMAX scalings on the training data.
+	void Fit(const Dataset* data);
+	void Fit(DatabaseStream* stream);
+
+	// Compute the feature matrix of a dataset.
+	void Apply(Dataset* data) const;
+
+	// Prints the features and their scaling, one per line.
+	void Print(ostream& outstream) const;
+
+private:
+	void ResetStatistics(void);
+	void Accumulate(const Dataset* data);
+	void FinishFit(void);
+};
+
+
+// Streams a sorted database from a binary cache, in blocks that never split a vehicle.
+// Blocks are read with pread(), so only one block is held in memory at a time.
+class DatabaseStream
+{
+public:
+	// Total number of entries, and cache size in bytes.
+	uint64_t	entries = 0;
+	uint64_t	bytes = 0;
+
+	// If set, the features of every block are computed as it is read.
+	const FeatureSchema* schema = 0;
+
+	~DatabaseStream();
+
+	// Open a cache for streaming, in blocks of about 'blockBytes' of entries.
+	// Returns false if the cache is missing, malformed, or does not match 'sourceFile'.
+	bool Open(string cacheFile, string sourceFile, uint64_t blockBytes);
+
+	// Go back to the first block.
+	void Rewind(void);
+
+	// Read the next block into 'block'. Returns false (and an empty block) past the last one.
+	bool NextBlock(Dataset* block);
+
+private:
+	int			fd = -1;
+	uint64_t	position = 0;
+	uint64_t	blockEntries = 0;
+	uint64_t	columnOffsets[SECTION_CONTACT_TIME+1];
+	vector<uint16_t> ids;
+
+	// Read entries [first,first+count) of one column into 'out'.
+	void ReadColumn(uint32_t section, uint64_t first, uint64_t count, void* out);
+};
+
+
+// Follows a growing CSV file, or a spool directory of CSV files, and parses only what was appended.
+class DatabaseFollower
+{
+public:
+	// Start following a file or directory. Returns false if it cannot be stat'ed.
+	bool Open(string path);
+
+	// Append every complete line added since the last poll to 'database' (unsorted), on up to 'threads' threads.
+	// Spool files are read in name order. A file that shrinks, or is replaced by another under its name, is
+	// read again from the start. Malformed lines are skipped and reported. Returns the number of bytes parsed.
+	uint64_t Poll(vector<DataEntry>* database, uint16_t threads=1);
+
+private:
+	string		path;
+	bool		directory = false;
+	// Per file, the bytes already parsed, and which file (device and inode) they were parsed from.
+	struct FollowedFile
+	{
+		uint64_t	offset = 0;
+		dev_t		device = 0;
+		ino_t		inode = 0;
+	};
+	map<string,FollowedFile> files;
+
+	uint64_t PollFile(string filename, vector<DataEntry>* database, uint16_t threads);
+};
+
+
+// For carrying a database load to its thread.
+struct threadDataLoadDatabase
+{
+	string				filename;
+	Dataset*			database;
+	bool				useCache;
+	uint16_t			threads;
+	DatabaseLoadStats	stats;
+};
+
+
+/* Functions
+   --------- */
+
+// Load a database, sorted by nodeID, then time, using up to 'threads' threads.
+// With 'useCache', a valid '<filename>.nrsu' cache is used instead of the CSV, and is written if missing or stale.
+DatabaseLoadStats LoadDatabase(string filename, Dataset* database, bool useCache=false, uint16_t threads=1);
+
+// Open a database for streaming from its '<filename>.nrsu' cache, in blocks of about 'blockBytes'.
+// A missing or stale cache is first rebuilt from the CSV in bounded memory.
+DatabaseLoadStats StreamDatabase(string filename, DatabaseStream* stream, uint64_t blockBytes, uint16_t threads=1);
+
+// For pthreading: runs LoadDatabase() on a threadDataLoadDatabase.
+void *ThreadLoadDatabase(void *threadarg);
+
+// Load a CSV database into memory, appending every entry to 'database' (unsorted).
+// The file is memory-mapped, split into line-aligned chunks, and each chunk parsed in place on its own thread.
+// Returns the number of bytes parsed.
+uint64_t LoadDatabaseCSV(string filename, vector<DataEntry>* database, uint16_t threads=1);
+
+// Parse the CSV text in [begin,end) into 'database'. 'fileStart' is only used for line numbers in error messages.
+// A malformed line exits, unless 'skipped' is given: then it is left out, and counted there.
+void ParseDatabaseCSV(const char* begin, const char* end, vector<DataEntry>* database, const char* fileStart=0, uint64_t* skipped=0);
+
+// Sort a database by nodeID, then time (stable), using up to 'threads' threads.
+void SortDatabase(vector<DataEntry>* database, uint16_t threads=1);
+
+// Map a sorted database from a binary cache, and use its columns in place. Returns false if the
+// cache is missing, malformed, or does not match 'sourceFile'.
+bool LoadDatabaseCache(string cacheFile, string sourceFile, Dataset* database, uint64_t* bytes=0);
+
+// Write a sorted database to a binary cache, tagged with the size, time and checksum of 'sourceFile'.
+void SaveDatabaseCache(string cacheFile, string sourceFile, const Dataset* database);
+
+// Publish a dataset, with its features and the schema they were computed with, as the POSIX
+// shared-memory object '/<name>'. It replaces any older object of that name, and outlives this process.
+void PublishDataset(string name, const Dataset* database, const FeatureSchema* schema);
+
+// Attach a published dataset, read-only and in place. 'schema' gets the schema of its features.
+// Returns false if there is no such dataset, or it is malformed.
+bool AttachDataset(string name, Dataset* database, string* schema);
+
+// Sort a CSV of any size into a binary cache, holding at most about 'runBytes' of CSV in memory at once.
+void BuildDatabaseCache(string cacheFile, string sourceFile, uint64_t runBytes, uint16_t threads=1);
+
+// Split the samples of a node_id into separate trips where they are more than 'seconds' apart, so a reused
+// node_id does not join unrelated trajectories. Applies to every database indexed from then on. 0 never splits.
+void SetTripGap(uint32_t seconds);
+
+// Bound an unsorted database: drop the entries more than 'maxSeconds' older than the latest one (0 keeps all), 
+// then the oldest past 'maxEntries' (0 keeps all), then keep only the 'maxVehicles' vehicles seen most recently
+// (by their latest relative_time). Returns the number of entries dropped.
+uint64_t SlideDatabaseWindow(vector<DataEntry>* database, uint32_t maxVehicles, uint32_t maxSeconds=0, uint64_t maxEntries=0);
+
+// Sample about 'fraction' of the vehicles of a dataset. A vehicle is in the sample depending only
+// on its node_id and 'seed', so a streamed database samples the same vehicles as when loaded whole.
+void SampleDataset(const Dataset* data, double fraction, uint64_t seed, DatasetSample* sample);
+
+// A fast 64-bit checksum of a file's contents.
+uint64_t ChecksumFile(string filename);
+
+
+#endif /* DATASET_H_ */
@@ -12,11 +12,14 @@
 #include <limits>
 
 #include <map>
+#include <set>
 #include <vector>
 #include <list>
 #include <string>
 
 #include "neatRSU.h"
+#include "dataset.h"
+#include "native.h"
 
 using namespace std;
 
@@ -24,6 +27,43 @@ using namespace std;
    ----------- */
 enum NodeType { SENSOR, HIDDEN, OUTPUT, BIAS };
 
+// How genomes are activated: by their compiled phenotype, by its bytecode, or by both, checking
+// that every prediction is identical.
+enum class Evaluator { PHENOTYPE, BYTECODE, VERIFY };
+extern Evaluator gm_evaluator;
+
+// Genomes unchanged for this many generations are activated by native code (0: never).
+extern uint32_t gm_nativeAfter;
+
+// Remember the error of every network evaluated on all the training data, and reuse it (see --fitness-cache).
+extern bool gm_fitnessCache;
+
+// Threads that share the evaluation of a single genome in GetFitness(), each over its own vehicles.
+extern uint16_t gm_genomeThreads;
+
+// Run the genomes of a species that share a topology as one network, a genome per SIMD lane (see --batch-topologies).
+extern bool gm_batchTopologies;
+
+// Most errors the fitness cache holds. When full, the errors of networks not seen in the current or
+// last generation are evicted, so those of the genomes alive (champions included) stay.
+#define GENOME_FITNESS_CACHE_SIZE (1<<20)
+
+// The arithmetic of fitness evaluation. In single precision, node values and weights are floats and the
+// transfer functions are approximated; lanes hold twice as many vehicles. Errors are summed in double.
+enum class Precision { DOUBLE, FLOAT };
+extern Precision gm_precision;
+
+// In lane evaluation, how many entries' errors are held before they are summed in order.
+#define GENOME_LANE_WINDOW 16384
+
+// Networks shaped like the initial one (see Phenotype::initial) with up to this many links run on a lane
+// kernel specialized to that shape.
+#define GENOME_INITIAL_LINKS 8
+
+// The data a species' genomes are run over in turn, in bytes of features and targets: half the L2
+// cache, or this if its size is unknown.
+#define GENOME_TILE_BYTES (256*1024)
+
 // Global innovation number
 extern uint16_t g_innovations;
 // List of innovations (pair(fromNode,toNode),innov#)
@@ -38,14 +78,38 @@ double ActivationSigmoid (double input);
 // MATLAB's tansig transfer function.
 double ActivationMatlabTanSig (double input);
 
+// Single precision approximations of the above, without exp(): within 3e-6 and 6e-6.
+float ActivationSigmoidFast (float input);
+float ActivationMatlabTanSigFast (float input);
+
 // Output transfer function.
 double ActivationOutput (double input);
 
+// Fitness from a sum of squared errors.
+double FitnessFromError (double sse);
+
+// The fitness cache: the sum of squared errors over all the training data of each network, by phenotype hash.
+// Safe to call from several threads.
+bool LookupFitnessCache(uint64_t hash, double* sse);
+void StoreFitnessCache(uint64_t hash, double sse);
+
+// Forget every cached error, when the training data changes.
+void ClearFitnessCache(void);
+
+// How many lookups the fitness cache had so far, and how many of them hit.
+void GetFitnessCacheStats(uint64_t* lookups, uint64_t* hits);
+
+// Of the genomes evaluated by species so far, how many ran batched with others of their topology, and in how many batches.
+void GetBatchStats(uint64_t* genomes, uint64_t* batched, uint64_t* batches);
+
 // Mates two genomes and returns the resulting offspring.
 // Uses each genome's fitness, so be sure it is up to date.
 class Genome;
 Genome MateGenomes(Genome* const firstParent, Genome* const secondParent);
 
+// The widest lane evaluation the CPU supports: 8 with AVX-512, 4 with AVX2, else 2.
+uint16_t SupportedLanes(void);
+
 // Get the measure of compatibility between two nodes
 double Compatibility(Genome* const gen1, Genome* const gen2);
 
@@ -68,16 +132,11 @@ public:
 	uint16_t	id;
 	NodeType	type;
 
-	// The following holds values throughout activations with recurrency
-	double		valueLast=0;
-	double		valueNow=0;
+	// Values throughout activations are held by the genome's Phenotype.
 
 	NodeGene(){};
 	NodeGene(uint16_t iid, NodeType ttype) 
-		{ 
-			id = iid; type = ttype; 
-			if(type==NodeType::BIAS) {valueNow=1; valueLast=1;}
-		}
+		{ id = iid; type = ttype; }
 };
 
 
@@ -101,6 +160,82 @@ public:
 };
 
 
+// A genome compiled for activation: its nodes at dense indices (sensors first, in order), its
+// enabled connections in innovation order, and the recurrent state as two flat arrays.
+class Phenotype
+{
+public:
+	struct Link
+	{
+		uint16_t	from;
+		uint16_t	to;
+		double		weight;
+	};
+
+	bool				compiled = false;
+	vector<Link>		links;
+	// Every genome that activates the same way has the same hash, whatever its ID or disabled genes.
+	uint64_t			hash = 0;
+	// The same, without the weights: phenotypes that differ only in weights share it.
+	uint64_t			topology = 0;
+	vector<uint16_t>	hidden;
+	uint16_t			output = 0;
+	uint16_t			bias = 0;
+	// No hidden nodes, and every link into the output: the shape Genome(n_inputs) starts with.
+	bool				initial = false;
+
+	// Node values on the previous and the current activation.
+	vector<double>		valueLast;
+	vector<double>		valueNow;
+
+	/* The same network as bytecode: one instruction per node, summing its incoming connections
+	 * (from 'sources' and 'weights', at 'operand') in order. A RUN reads 'count' consecutive nodes
+	 * from 'first', such as all the sensors. Interpret() runs it on its own copy of the state.
+	 */
+	enum Opcode { OP_INPUTS, OP_ACCUMULATE, OP_ACCUMULATE_SIGMOID, OP_RUN, OP_RUN_SIGMOID, OP_OUTPUT };
+	struct Instruction
+	{
+		uint16_t	op;
+		uint16_t	node;
+		uint16_t	count;
+		uint16_t	first;
+		uint32_t	operand;
+	};
+	vector<Instruction>	code;
+	vector<uint16_t>	sources;
+	vector<double>		weights;
+	vector<double>		codeLast;
+	vector<double>		codeNow;
+
+	// The bytecode compiled to native code (see native.h), once asked for, and its own state.
+	uint32_t			compiledGeneration = 0;
+	bool				nativeTried = false;
+	NativeActivation	native = 0;
+	vector<double>		nativeLast;
+	vector<double>		nativeNow;
+
+	// Build from a genome's genes, with a clean state. Only live nodes (see Genome::LiveNodes) and the
+	// connections into them are kept, besides the sensors and bias.
+	void Compile(const Genome& genome);
+
+	// Clean the recurrent state.
+	void Reset(void);
+
+	// Push a row of input features through the network, and return the value of the output node.
+	double Activate(const float* features);
+
+	// Same as Activate(), through the bytecode.
+	double Interpret(const float* features);
+
+	// Same as Activate(), through the native code. It must be loaded.
+	double RunNative(const float* features);
+
+private:
+	// Lower 'links' to 'code'.
+	void Lower(void);
+};
+
+
 // A genome has a set of nodes and a set of connections.
 // Include routines to manipulate the genome and verify its structure.
 class Genome
@@ -115,9 +250,26 @@ public:
 	double fitness = 0;
 	double adjFitness = 0;
 
+	// Sum of squared errors, accumulated over the blocks of a streamed database.
+	double sse = 0;
+
+	// True if 'fitness' was estimated on part of the training data (see --fitness-sample, --coarse-to-fine).
+	bool sampledFitness = false;
+
+	// True if evaluation stopped early, once 'sse' passed its species' survival boundary or stopped being finite.
+	// 'sse' then only covers the segments before 'culledAfter', and the genome is sure to be killed.
+	bool culled = false;
+	size_t culledAfter = 0;
+
+	// True if 'sse' was taken from the fitness cache, so the genome is not evaluated.
+	bool cachedFitness = false;
+
 	// A unique random identifier for this genome.
 	uint64_t id = 0; 
 
+	// The network as run by Activate(), compiled on first use and kept (and copied) until the genes change.
+	Phenotype phenotype;
+
 	/* Essentials
 	 */ 
 	// A blank genome, for copies and mating, with a random ID.
@@ -136,16 +288,50 @@ public:
 	// Returns false if the connection already exists. If reenable==true, replaces a disabled connection, if it exists.
 	bool AddConnection(uint16_t from, uint16_t to, bool reenable=false, double inWeight=DBL_MAX);
 
-	// Push a set of inputs through a genome, and return the value of the output node.
-	double Activate(DataEntry entry);
+	// Push a row of input features through a genome, and return the value of the output node.
+	// Recurrent state carries over from the previous call: reset the nodes at the start of every segment.
+	double Activate(const float* features);
 
 	// Run a complete DB through this genome, compute every prediction, and return fitness.
-	// If store==true, store each prediction in the database at database[i]->prediction;
-	double GetFitness(vector<DataEntry>* database, bool store=false);
+	// If 'predictions' is given, store the prediction for entry i at predictions[i] (the caller sizes it).
+	double GetFitness(const Dataset* database, double* predictions=0);
+
+	// Run every block of a streamed DB through this genome, and return fitness.
+	double GetFitness(DatabaseStream* stream);
+
+	// Run a DB through this genome, adding each squared error to 'sse' in order.
+	// A database evaluated block by block (on vehicle boundaries) sums to exactly the same as when evaluated whole.
+	void AccumulateError(const Dataset* database, double* sse, double* predictions=0);
+
+	// Run the sampled segments of a DB through this genome, adding each squared error to 'sse' in order.
+	void AccumulateError(const Dataset* database, const DatasetSample* sample, double* sse);
+
+	// Run a single segment (vehicle) of a DB through this genome from a clean state, adding each squared error to 'sse'.
+	// If 'rowErrors' is given, each squared error is also stored at its entry, as with 'predictions'.
+	void AccumulateError(const Dataset* database, const DatasetSegment& segment, double* sse, double* predictions=0, double* rowErrors=0);
+
+	// Run a list of segments of a DB through this genome, adding each squared error to 'sse' in order.
+	void AccumulateError(const Dataset* database, const DatasetSegment* segments, size_t count, double* sse, double* predictions=0, double* rowErrors=0);
+
+	// Same as AccumulateError() on a whole DB, split across gm_genomeThreads threads at vehicle boundaries.
+	// The errors are summed in entry order after the threads finish, so 'sse' is exactly the same.
+	void AccumulateErrorThreads(const Dataset* database, double* sse, double* predictions=0);
+
+	/* Run a list of segments through this genome, gm_lanes vehicles at a time in SIMD lanes.
+	 * Squared errors are still added to 'sse' in entry order, so the sum is exactly the same as
+	 * running the segments one after another. In single precision, 2*gm_lanes vehicles at a time.
+	 */
+	void AccumulateErrorLanes(const Dataset* database, const DatasetSegment* segments, size_t count, double* sse, double* predictions=0, double* rowErrors=0);
 
 	// Wipe the values inside the nodes.
 	void WipeMemory(void);
 
+	// Load native code for the phenotype, compiling it if not cached. On failure, the phenotype goes on as it was.
+	void CompileNative(void);
+
+	// Drop the compiled phenotype. Every change to 'nodes' or 'connections' must call this.
+	void InvalidatePhenotype(void) { phenotype.compiled = false; }
+
 	/* Mutations1
 	 */
 	// Add a random value to the weights of this genome.
@@ -170,6 +356,13 @@ public:
 	// Count the number of ConnectionGenes that are not disabled.
 	pair<uint16_t,uint16_t> CountEnabledGenes(void);
 
+	// The nodes that can affect the output through enabled connections, at any later step. Includes the output.
+	set<uint16_t> LiveNodes(void) const;
+
+	// A copy without the hidden nodes and connections that cannot affect the output, nor disabled connections.
+	// It activates exactly as this genome does.
+	Genome Pruned(void) const;
+
 	// Resets the nodes' memories.
 	void ResetNodes();
 
@@ -204,6 +397,10 @@ public:
 	// For thread tracking.
 	bool thread_processing = false;
 
+	// Sum of squared errors of the worst genome to survive the last cull, if that generation was evaluated
+	// on all the training data. Next generation, genomes whose error passes it stop being evaluated.
+	double survivalError = INFINITY;
+
 	// For tracking the species champion.
 	Genome* champion;
 
@@ -223,8 +420,24 @@ public:
 	// Finds the best genome in the species and returns a pointer to it.
 	Genome* FindChampion(void);
 
-	// Update the fitness on all genomes. Ideal for pthreading.
-	void UpdateGenomeFitness(vector<DataEntry>* database);
+	/* Update the fitness on all genomes of a group of species, run over the data together. Ideal for pthreading.
+	 * Genomes are culled past their species' 'survivalError'. If more are culled in a species than the 
+	 * 'survivalThreshold' fraction that will be killed, its culled genomes are evaluated to the end, so every 
+	 * survivor's fitness is exact.
+	 */
+	static void UpdateGenomeFitness(const vector<Species*>& group, const Dataset* database, float survivalThreshold);
+
+	// Add the errors of a database (or one block of a streamed one) to the 'sse' of every genome of a group of 
+	// species. Every genome of the group runs over a cache-sized tile of vehicles before the next tile is read,
+	// so the data is read once per group. With a 'sample', only its segments are run. Culled genomes are skipped, 
+	// and genomes are culled once their error is not finite or, with 'cull', past their species' 'survivalError'.
+	static void AccumulateGenomeError(const vector<Species*>& group, const Dataset* database, 
+		const DatasetSample* sample=0, bool cull=false);
+
+	// Before and after UpdateGenomeFitness() runs the group: reset (or take from the fitness cache) each 
+	// genome's error, then finish the culled genomes that survive, and set every fitness.
+	void PrepareGenomeFitness(void);
+	void FinishGenomeFitness(const Dataset* database, float survivalThreshold);
 
 	// Prints a summary of the species statistics and its genomes.
 	void Print(ostream& outstream);
@@ -259,14 +472,23 @@ public:
 	void PrintSpeciesSize(ostream& outstream);
 
 	// Prints a (generation,bestFitness) pair.
-	void PrintFitness(ostream& outstream, vector<DataEntry>* database1, vector<DataEntry>* database2=0);
+	void PrintFitness(ostream& outstream, const Dataset* database1, const Dataset* database2=0);
+	void PrintFitness(ostream& outstream, DatabaseStream* stream1, DatabaseStream* stream2=0);
 };
 
 // For carrying pointers to the thread routine.
 struct threadDataUpdateGenomeFitness
 {
 	Population* populationPointer;
-	vector<DataEntry>* database;
+	const Dataset* database;
+	// If set, only these segments of 'database' are evaluated (ThreadAccumulateGenomeError only).
+	const DatasetSample* sample = 0;
+	// The fraction of each species killed after evaluation (ThreadUpdateGenomeFitness only).
+	float survivalThreshold = 0;
+	// Threads sharing the population, each claiming about as many genomes.
+	uint16_t threadCount = 1;
+	// Guards Species::thread_processing, so each species is claimed by a single thread.
+	pthread_mutex_t claimLock = PTHREAD_MUTEX_INITIALIZER;
 };
 
 
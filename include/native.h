@@ -0,0 +1,48 @@
+/* Andre Braga Reis, 2016
+ */
+
+#ifndef NATIVE_H_
+#define NATIVE_H_
+
+#include <string>
+
+#include "neatRSU.h"
+
+using namespace std;
+
+
+/* Definitions
+   ----------- */
+
+/* Native activation.
+ * A phenotype's bytecode written out as straight-line C, with its weights as constants, compiled
+ * by the system's cc into a shared object and loaded with dlopen(). Objects are kept in a cache
+ * directory, named by the structural hash of the network, so later generations and later runs
+ * load them again instead of compiling.
+ */
+#define NATIVE_COMPILER 		"cc -O2 -ffp-contract=off -fPIC -shared"
+#define NATIVE_SYMBOL 			"neatrsu_activate"
+#define NATIVE_DEFAULT_CACHE	".neatRSU-native"
+
+// One activation step: same arguments and state as Phenotype::Interpret(), plus the transfer functions.
+typedef double (*NativeActivation)(const float* features, double* last, double* now,
+	double (*sigmoid)(double), double (*output)(double));
+
+class Phenotype;
+
+
+/* Functions
+   --------- */
+
+// Use 'directory' as the cache of compiled modules, creating it if needed. Exits if it cannot be created.
+void SetNativeCache(string directory);
+
+// The native activation of a compiled phenotype, from the cache or compiled now. Returns 0 if it cannot be built.
+// Safe to call from several threads.
+NativeActivation LoadNativeActivation(const Phenotype& phenotype);
+
+// How many modules were compiled, and how many loaded from the cache, so far.
+void GetNativeStats(uint32_t* compiled, uint32_t* cached);
+
+
+#endif /* NATIVE_H_ */
@@ -30,7 +30,7 @@ using namespace std;
    ----------- */
 extern uint16_t gm_debug;
 extern uint32_t g_generationNumber;
-extern const uint16_t g_inputs;
+extern uint16_t g_inputs;
 extern map<uint16_t,string> g_nodeNames;
 // Warning: these are IDs (suitable for e.g. std::map), not vector indices
 extern uint16_t d_outputnode;
@@ -41,6 +41,7 @@ extern float gm_compat_excess;
 extern float gm_compat_disjoint; 
 extern float gm_compat_weight; 
 extern bool  gm_limitInitialGrowth;
+extern uint16_t gm_lanes;
 
 extern float g_m_p_mutate_weights;
 extern float g_m_p_mutate_addnode;
@@ -63,12 +64,29 @@ extern boost::random::normal_distribution<> 	g_rnd_gauss;
 // Given a probability, returns a Bernoulli outcome.
 bool OneShotBernoulli(float probability);
 
+// Mix a run of bytes into a 64-bit FNV-1a hash. Start from NEATRSU_HASH_SEED.
+#define NEATRSU_HASH_SEED 0xcbf29ce484222325ULL
+void HashBytes(uint64_t* hash, const void* data, size_t bytes);
+
 // Auxiliary for std::sort, will sort a database by nodeID, then time.
 class DataEntry;
 bool sortIdThenTime( DataEntry const &first, DataEntry const &second );
 
 // For pthreading.
 void *ThreadUpdateGenomeFitness(void *threadarg);
+void *ThreadAccumulateGenomeError(void *threadarg);
+
+// Run 'routine' on every thread in 'threads' over the population in 'td', and wait for them.
+struct threadDataUpdateGenomeFitness;
+void RunGenomeFitnessThreads(void *(*routine)(void *), threadDataUpdateGenomeFitness* td, vector<pthread_t>& threads);
+
+// Re-score sampled species champions on the full training data (from 'stream' if given). Returns the entries run.
+class Population; class Dataset; class DatabaseStream;
+uint64_t ValidateChampions(Population* population, const Dataset* database, DatabaseStream* stream);
+
+// Compare a genome's single precision fitness and predictions with double precision, on 'database' (or 'stream').
+class Genome;
+void ReportPrecision(Genome* genome, const Dataset* database, DatabaseStream* stream);
 
 
 /* Classes and Structs
@@ -87,19 +105,8 @@ public:
 	uint16_t	heading;
 	// uint16_t	rsu_id;
 	uint32_t	contact_time;
-	double		prediction=0;
-
-	DataEntry(vector<string> in)
-	{
-		node_id 		= boost::lexical_cast<uint16_t>	(in[0]) ;
-		relative_time	= boost::lexical_cast<uint32_t>	(in[1]) ;
-		latitude		= boost::lexical_cast<float>	(in[2]) ;
-		longitude		= boost::lexical_cast<float>	(in[3]) ;
-		speed			= boost::lexical_cast<uint16_t>	(in[4]) ;
-		heading			= boost::lexical_cast<uint16_t>	(in[5]) ;
-		// rsu_id			= boost::lexical_cast<uint16_t>	(in[6]) ;
-        contact_time    = boost::lexical_cast<uint32_t>	(in[7]) ;
-	}
+
+	DataEntry(){};
 
     bool operator < (const DataEntry& entry) const
         { return (relative_time < entry.relative_time); }
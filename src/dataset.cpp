@@ -0,0 +1,1789 @@
+/* Andre Braga Reis, 2016
+ */
+
+#include "dataset.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <queue>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// Map a whole file read-only. Returns 0 if it cannot be opened, or is empty.
+static const char* MapFile(string filename, uint64_t* size)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0) return 0;
+
+	struct stat fileStat;
+	if( (fstat(fd, &fileStat) != 0) or (fileStat.st_size == 0) ) { close(fd); return 0; }
+	*size = fileStat.st_size;
+
+	// The mapping stays valid after the descriptor is closed.
+	void* mapping = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return (mapping == MAP_FAILED) ? 0 : (const char*)mapping;
+}
+
+
+// Size and modification time (in ns) of a file. Returns false if it cannot be stat'ed.
+static bool StatFile(string filename, uint64_t* size, int64_t* mtime)
+{
+	struct stat fileStat;
+	if(stat(filename.c_str(), &fileStat) != 0) return false;
+	*size = fileStat.st_size;
+	*mtime = (int64_t)fileStat.st_mtim.tv_sec*1000000000 + fileStat.st_mtim.tv_nsec;
+	return true;
+}
+
+
+static uint64_t ChecksumBuffer(const char* data, uint64_t size)
+{
+	// Word-at-a-time multiply/xorshift mix. Not cryptographic, just quick to detect changed files.
+	uint64_t hash = 0x9E3779B97F4A7C15ULL ^ size;
+	uint64_t word, i = 0;
+	for(; i+8 <= size; i += 8)
+	{
+		memcpy(&word, data+i, 8);
+		hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+		hash ^= hash >> 32;
+	}
+	for(; i < size; i++)
+		hash = (hash ^ (uint8_t)data[i]) * 0x100000001B3ULL;
+	return hash;
+}
+
+
+uint64_t ChecksumFile(string filename)
+{
+	uint64_t size = 0;
+	const char* data = MapFile(filename, &size);
+	if(!data) return ChecksumBuffer(0, 0);
+
+	madvise((void*)data, size, MADV_SEQUENTIAL);
+	uint64_t hash = ChecksumBuffer(data, size);
+	munmap((void*)data, size);
+	return hash;
+}
+
+
+
+/* CSV parsing helpers.
+ * Each helper parses one field starting at 'p', stops at the next delimiter
+ * (',', '\r', '\n' or 'end') and returns a pointer to it, or 0 if the field is malformed.
+ */
+
+static inline bool IsDelimiter(const char* p, const char* end)
+	{ return (p == end) or (*p == ',') or (*p == '\n') or (*p == '\r'); }
+
+
+static inline const char* ParseUnsigned(const char* p, const char* end, uint64_t maxValue, uint64_t& value)
+{
+	const char* start = p;
+	value = 0;
+	while( !IsDelimiter(p,end) )
+	{
+		if( (*p < '0') or (*p > '9') ) return 0;
+		value = value*10 + (*p - '0');
+		if(value > maxValue) return 0;
+		p++;
+	}
+	return (p == start) ? 0 : p;
+}
+
+
+static inline const char* ParseFloat(const char* p, const char* end, float& value)
+{
+	// Copy the field to a small buffer so strtof() sees a terminated string.
+	char buffer[64];
+	uint16_t length = 0;
+	while( !IsDelimiter(p,end) )
+	{
+		if(length == sizeof(buffer)-1) return 0;
+		buffer[length++] = *p++;
+	}
+	if(length == 0) return 0;
+	buffer[length] = '\0';
+
+	char* parsedEnd;
+	value = strtof(buffer, &parsedEnd);
+	return (parsedEnd == buffer+length) ? p : 0;
+}
+
+
+static inline const char* SkipField(const char* p, const char* end)
+{
+	while( !IsDelimiter(p,end) ) p++;
+	return p;
+}
+
+
+// Move past a ',' delimiter. Returns 0 if the line ended early.
+static inline const char* NextField(const char* p, const char* end)
+	{ return ( p and (p != end) and (*p == ',') ) ? p+1 : 0; }
+
+
+
+void ParseDatabaseCSV(const char* begin, const char* end, vector<DataEntry>* database, const char* fileStart, uint64_t* skipped)
+{
+	const char* p = begin;
+
+	while(p < end)
+	{
+		// Skip empty lines (and the '\n' of '\r\n' endings)
+		if( (*p == '\n') or (*p == '\r') )
+			{ p++; continue; }
+
+		/* Fields: node_id, relative_time, latitude, longitude, speed, heading, rsu_id, contact_time
+		 * rsu_id is not used, and anything after contact_time is ignored.
+		 */
+		DataEntry entry;
+		uint64_t id=0, relTime=0, speed=0, heading=0, contact=0;
+		const char* q = p;
+
+		q = ParseUnsigned(q, end, UINT16_MAX, id);
+		if(q) q = NextField(q,end);
+		if(q) q = ParseUnsigned(q, end, UINT32_MAX, relTime);
+		if(q) q = NextField(q,end);
+		if(q) q = ParseFloat(q, end, entry.latitude);
+		if(q) q = NextField(q,end);
+		if(q) q = ParseFloat(q, end, entry.longitude);
+		if(q) q = NextField(q,end);
+		if(q) q = ParseUnsigned(q, end, UINT16_MAX, speed);
+		if(q) q = NextField(q,end);
+		if(q) q = ParseUnsigned(q, end, UINT16_MAX, heading);
+		if(q) q = NextField(q,end);
+		if(q) q = SkipField(q, end);
+		if(q) q = NextField(q,end);
+		if(q) q = ParseUnsigned(q, end, UINT32_MAX, contact);
+
+		if( !q and skipped )
+		{
+			(*skipped)++;
+			const char* newline = (const char*)memchr(p, '\n', end-p);
+			p = newline ? newline+1 : end;
+			continue;
+		}
+		if(!q)
+		{
+			// Only count lines when we need to report one.
+			if(!fileStart) fileStart = begin;
+			uint64_t lineNumber = 1 + count(fileStart, p, '\n');
+			cout << "\nERROR\tMalformed entry on line " << lineNumber << "." << endl; exit(1);
+		}
+
+		entry.node_id 		= id;
+		entry.relative_time	= relTime;
+		entry.speed			= speed;
+		entry.heading		= heading;
+		entry.contact_time	= contact;
+		database->push_back(entry);
+
+		// Move on to the next line
+		const char* newline = (const char*)memchr(q, '\n', end-q);
+		p = newline ? newline+1 : end;
+	}
+}
+
+
+
+// Launch 'count' pthreads running 'routine' on each element of 'args', and wait for all of them.
+template<typename T>
+static void RunThreads(void *(*routine)(void *), vector<T>& args)
+{
+	vector<pthread_t> threads(args.size());
+	for(uint16_t tId = 0; tId < args.size(); tId++)
+	{
+		int rc = pthread_create(&threads[tId], NULL, routine, (void *)&args[tId]);
+		assert(rc == 0);
+	}
+	for(uint16_t tId = 0; tId < args.size(); tId++)
+	{
+		int rc = pthread_join(threads[tId], NULL);
+		assert(rc == 0);
+	}
+}
+
+
+// For carrying a chunk of CSV text to a parsing thread.
+struct threadDataParseCSV
+{
+	const char* begin;
+	const char* end;
+	const char* fileStart;
+	uint64_t* skipped;
+	uint64_t chunkSkipped;
+	vector<DataEntry> entries;
+};
+
+
+static void *ThreadParseCSV(void *threadarg)
+{
+	threadDataParseCSV* chunk = (threadDataParseCSV *) threadarg;
+	chunk->entries.reserve( (chunk->end - chunk->begin)/40 );
+	chunk->chunkSkipped = 0;
+	ParseDatabaseCSV(chunk->begin, chunk->end, &chunk->entries, chunk->fileStart, chunk->skipped ? &chunk->chunkSkipped : 0);
+	pthread_exit(NULL);
+}
+
+
+// Parse the CSV text in [text,textEnd) on up to 'threads' threads, each on a line-aligned chunk.
+// With 'skipped', malformed lines are counted there and left out (see ParseDatabaseCSV).
+static void ParseDatabaseCSVParallel(const char* text, const char* textEnd, vector<DataEntry>* database, uint16_t threads, 
+	const char* fileStart, uint64_t* skipped=0)
+{
+	const uint64_t textSize = textEnd-text;
+
+	// Small files are not worth splitting.
+	const uint64_t minChunkSize = 1<<20;
+	if(threads < 1) threads = 1;
+	if(textSize/threads < minChunkSize) threads = textSize/minChunkSize + 1;
+
+	if(threads == 1)
+	{
+		database->reserve( database->size() + textSize/40 );
+		ParseDatabaseCSV(text, textEnd, database, fileStart, skipped);
+	}
+	else
+	{
+		// Split the text into one chunk per thread, each ending on a line break.
+		vector<threadDataParseCSV> chunks(threads);
+		const char* chunkBegin = text;
+		for(uint16_t tId = 0; tId < threads; tId++)
+		{
+			const char* chunkEnd = (tId == threads-1) ? textEnd : text + textSize/threads*(tId+1);
+			if(chunkEnd < chunkBegin) chunkEnd = chunkBegin;
+			const char* newline = (const char*)memchr(chunkEnd, '\n', textEnd-chunkEnd);
+			chunkEnd = newline ? newline+1 : textEnd;
+
+			chunks[tId].begin = chunkBegin;
+			chunks[tId].end = chunkEnd;
+			chunks[tId].fileStart = fileStart;
+			chunks[tId].skipped = skipped;
+			chunkBegin = chunkEnd;
+		}
+
+		RunThreads(ThreadParseCSV, chunks);
+
+		// Append the chunks in file order.
+		uint64_t totalEntries = database->size();
+		for(uint16_t tId = 0; tId < threads; tId++)
+			totalEntries += chunks[tId].entries.size();
+		database->reserve(totalEntries);
+		for(uint16_t tId = 0; tId < threads; tId++)
+		{
+			if(skipped) *skipped += chunks[tId].chunkSkipped;
+			database->insert(database->end(), chunks[tId].entries.begin(), chunks[tId].entries.end());
+			vector<DataEntry>().swap(chunks[tId].entries);
+		}
+	}
+}
+
+
+uint64_t LoadDatabaseCSV(string filename, vector<DataEntry>* database, uint16_t threads)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0) { cout << "\nERROR\tFailed to open file." << endl; exit(1); }
+
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) != 0) { cout << "\nERROR\tFailed to stat file." << endl; exit(1); }
+
+	uint64_t fileSize = fileStat.st_size;
+	if(fileSize == 0) { close(fd); return 0; }
+
+	// Map the whole file, we only read it front to back once.
+	void* mapping = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(mapping == MAP_FAILED) { cout << "\nERROR\tFailed to map file." << endl; exit(1); }
+	madvise(mapping, fileSize, MADV_SEQUENTIAL);
+	const char* text = (const char*)mapping;
+	const char* textEnd = text + fileSize;
+
+	ParseDatabaseCSVParallel(text, textEnd, database, threads, text);
+
+	munmap(mapping, fileSize);
+	close(fd);
+
+	return fileSize;
+}
+
+
+
+// For carrying a slice of the database to a sorting thread.
+struct threadDataSortDatabase
+{
+	const vector<DataEntry>* input;
+	vector<DataEntry>* output;
+	uint64_t begin, end;
+	// One counter (and later, one write position) per node_id.
+	vector<uint64_t> position;
+	// Buckets (node_ids) this thread sorts by time.
+	vector<pair<uint64_t,uint64_t> > buckets;
+};
+
+
+static void *ThreadCountNodeIds(void *threadarg)
+{
+	threadDataSortDatabase* slice = (threadDataSortDatabase *) threadarg;
+	slice->position.assign(UINT16_MAX+1, 0);
+	for(uint64_t i = slice->begin; i < slice->end; i++)
+		slice->position[ (*slice->input)[i].node_id ]++;
+	pthread_exit(NULL);
+}
+
+
+static void *ThreadScatterNodeIds(void *threadarg)
+{
+	threadDataSortDatabase* slice = (threadDataSortDatabase *) threadarg;
+	for(uint64_t i = slice->begin; i < slice->end; i++)
+	{
+		const DataEntry& entry = (*slice->input)[i];
+		(*slice->output)[ slice->position[entry.node_id]++ ] = entry;
+	}
+	pthread_exit(NULL);
+}
+
+
+static void *ThreadSortBuckets(void *threadarg)
+{
+	threadDataSortDatabase* slice = (threadDataSortDatabase *) threadarg;
+	for(uint64_t b = 0; b < slice->buckets.size(); b++)
+	{
+		vector<DataEntry>::iterator first = slice->output->begin() + slice->buckets[b].first;
+		vector<DataEntry>::iterator last = slice->output->begin() + slice->buckets[b].second;
+		// Traces are usually already in time order.
+		if(!is_sorted(first, last, sortIdThenTime))
+			stable_sort(first, last, sortIdThenTime);
+	}
+	pthread_exit(NULL);
+}
+
+
+void SortDatabase(vector<DataEntry>* database, uint16_t threads)
+{
+	/* A stable radix pass on node_id, followed by a stable sort on time inside each node_id.
+	 * Every step is split across threads, and the result does not depend on the thread count.
+	 */
+	uint64_t size = database->size();
+	if(threads < 1) threads = 1;
+	if(size < (uint64_t)threads*65536) threads = size/65536 + 1;
+
+	vector<DataEntry> input;
+	input.swap(*database);
+	database->resize(size);
+
+	vector<threadDataSortDatabase> slices(threads);
+	for(uint16_t tId = 0; tId < threads; tId++)
+	{
+		slices[tId].input = &input;
+		slices[tId].output = database;
+		slices[tId].begin = size/threads*tId;
+		slices[tId].end = (tId == threads-1) ? size : size/threads*(tId+1);
+	}
+
+	// Count each node_id per slice.
+	RunThreads(ThreadCountNodeIds, slices);
+
+	// Turn counts into write positions: by node_id, then by slice.
+	uint64_t offset = 0;
+	vector<pair<uint64_t,uint64_t> > buckets;
+	for(uint32_t id = 0; id <= UINT16_MAX; id++)
+	{
+		uint64_t bucketBegin = offset;
+		for(uint16_t tId = 0; tId < threads; tId++)
+		{
+			uint64_t count = slices[tId].position[id];
+			slices[tId].position[id] = offset;
+			offset += count;
+		}
+		if(offset > bucketBegin) buckets.push_back(make_pair(bucketBegin, offset));
+	}
+
+	// Scatter entries into their node_id buckets.
+	RunThreads(ThreadScatterNodeIds, slices);
+	vector<DataEntry>().swap(input);
+
+	// Sort each bucket by time. Hand out buckets round-robin.
+	for(uint64_t b = 0; b < buckets.size(); b++)
+		slices[b % threads].buckets.push_back(buckets[b]);
+	RunThreads(ThreadSortBuckets, slices);
+}
+
+
+
+DatabaseLoadStats LoadDatabase(string filename, Dataset* database, bool useCache, uint16_t threads)
+{
+	DatabaseLoadStats stats;
+	chrono::steady_clock::time_point loadStart = chrono::steady_clock::now();
+
+	string cacheFile = filename + ".nrsu";
+	if(useCache and LoadDatabaseCache(cacheFile, filename, database, &stats.bytes))
+		stats.fromCache = true;
+	else
+	{
+		vector<DataEntry> entries;
+		stats.bytes = LoadDatabaseCSV(filename, &entries, threads);
+
+		// Sort by NodeID, then Time, and split into columns.
+		SortDatabase(&entries, threads);
+		database->Assign(entries);
+		vector<DataEntry>().swap(entries);
+
+		if(useCache)
+			{ SaveDatabaseCache(cacheFile, filename, database); stats.cacheWritten = true; }
+	}
+
+	stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+	return stats;
+}
+
+
+
+// Element size of each cache section, by CacheSectionId.
+static const uint32_t g_cacheElementSize[SECTION_CONTACT_TIME+1] = {0, 2, 4, 4, 4, 2, 2, 4};
+
+// Seconds between two samples of a node_id past which they belong to separate trips. 0 never splits.
+static uint32_t g_tripGap = 0;
+
+
+// Fill in a cache header for 'entries' entries of 'sourceFile', and lay out its sections,
+// each aligned after the previous one.
+static void LayoutCache(CacheHeader* header, vector<CacheSection>* sections, uint64_t entries, string sourceFile)
+{
+	memcpy(header->magic, DATASET_CACHE_MAGIC, 4);
+	header->version = DATASET_CACHE_VERSION;
+	header->entries = entries;
+	header->sectionCount = SECTION_CONTACT_TIME;
+	header->headerBytes = sizeof(CacheHeader);
+	if(!StatFile(sourceFile, &header->sourceSize, &header->sourceMtime))
+		{ cout << "\nERROR\tFailed to stat file." << endl; exit(1); }
+	header->sourceChecksum = ChecksumFile(sourceFile);
+
+	sections->resize(header->sectionCount);
+	uint64_t offset = sizeof(CacheHeader) + header->sectionCount*sizeof(CacheSection);
+	for(uint32_t i = 0; i < header->sectionCount; i++)
+	{
+		offset = (offset + DATASET_CACHE_ALIGN-1) / DATASET_CACHE_ALIGN * DATASET_CACHE_ALIGN;
+		(*sections)[i].id = i+1;
+		(*sections)[i].elementSize = g_cacheElementSize[i+1];
+		(*sections)[i].offset = offset;
+		(*sections)[i].bytes = entries*(*sections)[i].elementSize;
+		offset += (*sections)[i].bytes;
+	}
+}
+
+
+// Check a cache header and its section table against the cache size and the source file (if any).
+// On success, 'columnOffsets' holds the file offset of every column, by CacheSectionId.
+static bool ValidateCache(const CacheHeader* header, const CacheSection* sections, uint64_t cacheSize, string sourceFile, uint64_t* columnOffsets)
+{
+	if( 	(memcmp(header->magic, DATASET_CACHE_MAGIC, 4) != 0)
+		or 	(header->version != DATASET_CACHE_VERSION)
+		or 	(header->headerBytes != sizeof(CacheHeader))
+		or 	(sizeof(CacheHeader) + header->sectionCount*sizeof(CacheSection) > cacheSize) )
+		return false;
+
+	// Without a source file (a published dataset), there is nothing to match.
+	if(!sourceFile.empty())
+	{
+		uint64_t sourceSize; int64_t sourceMtime;
+		if( !StatFile(sourceFile, &sourceSize, &sourceMtime) or (header->sourceSize != sourceSize) )
+			return false;
+
+		// A different modification time alone (e.g. a copied file) is fine if the contents match.
+		if( (header->sourceMtime != sourceMtime) and (header->sourceChecksum != ChecksumFile(sourceFile)) )
+			return false;
+	}
+
+	// Locate every column.
+	for(uint32_t id = 0; id <= SECTION_CONTACT_TIME; id++)
+		columnOffsets[id] = 0;
+	for(uint32_t i = 0; i < header->sectionCount; i++)
+		if( 	(sections[i].id >= SECTION_NODE_ID) and (sections[i].id <= SECTION_CONTACT_TIME)
+			and (sections[i].elementSize == g_cacheElementSize[sections[i].id])
+			and (sections[i].bytes == header->entries*sections[i].elementSize)
+			and (sections[i].offset + sections[i].bytes <= cacheSize) )
+			columnOffsets[sections[i].id] = sections[i].offset;
+
+	for(uint32_t id = SECTION_NODE_ID; id <= SECTION_CONTACT_TIME; id++)
+		if(!columnOffsets[id]) return false;
+	return true;
+}
+
+
+// Bytes per entry, over all columns.
+static uint64_t CacheEntryBytes(void)
+{
+	uint64_t bytes = 0;
+	for(uint32_t id = SECTION_NODE_ID; id <= SECTION_CONTACT_TIME; id++)
+		bytes += g_cacheElementSize[id];
+	return bytes;
+}
+
+
+// Write 'bytes' at 'offset', retrying on short writes. Exits on failure.
+static void WriteFully(int fd, const void* data, uint64_t bytes, uint64_t offset)
+{
+	const char* p = (const char*)data;
+	while(bytes > 0)
+	{
+		ssize_t written = pwrite(fd, p, bytes, offset);
+		if(written <= 0) { cout << "\nERROR\tFailed to write file." << endl; exit(1); }
+		p += written; bytes -= written; offset += written;
+	}
+}
+
+
+// Read 'bytes' at 'offset', retrying on short reads. Returns false on failure.
+static bool ReadFully(int fd, void* data, uint64_t bytes, uint64_t offset)
+{
+	char* p = (char*)data;
+	while(bytes > 0)
+	{
+		ssize_t got = pread(fd, p, bytes, offset);
+		if(got <= 0) return false;
+		p += got; bytes -= got; offset += got;
+	}
+	return true;
+}
+
+
+
+bool LoadDatabaseCache(string cacheFile, string sourceFile, Dataset* database, uint64_t* bytes)
+{
+	uint64_t cacheSize = 0;
+	const char* cache = MapFile(cacheFile, &cacheSize);
+	if(!cache) return false;
+
+	const CacheHeader* header = (const CacheHeader*)cache;
+	uint64_t columnOffsets[SECTION_CONTACT_TIME+1];
+	if( (cacheSize < sizeof(CacheHeader)) 
+		or !ValidateCache(header, (const CacheSection*)(cache + sizeof(CacheHeader)), cacheSize, sourceFile, columnOffsets) )
+		{ munmap((void*)cache, cacheSize); return false; }
+
+	// The columns are used in place, so the dataset keeps the mapping.
+	if(bytes) *bytes = cacheSize;
+	database->AssignMapping((void*)cache, cacheSize, header->entries, columnOffsets);
+	return true;
+}
+
+
+
+// Buffers one cache column and writes it out at its section offset.
+class CacheColumnWriter
+{
+public:
+	int fd;
+	uint64_t offset;
+	vector<char> buffer;
+
+	CacheColumnWriter(int ffd, uint64_t ooffset) { fd = ffd; offset = ooffset; buffer.reserve(1<<16); }
+
+	void Put(const void* data, uint32_t size)
+	{
+		buffer.insert(buffer.end(), (const char*)data, (const char*)data+size);
+		if(buffer.size() >= (1<<16)) Flush();
+	}
+
+	void Flush(void)
+		{ WriteFully(fd, buffer.data(), buffer.size(), offset); offset += buffer.size(); buffer.clear(); }
+};
+
+
+// Append one entry to the columns of an open cache file.
+static void WriteCacheEntry(vector<CacheColumnWriter>& columns, const DataEntry& entry)
+{
+	columns[SECTION_NODE_ID-1].Put(&entry.node_id, 2);
+	columns[SECTION_RELATIVE_TIME-1].Put(&entry.relative_time, 4);
+	columns[SECTION_LATITUDE-1].Put(&entry.latitude, 4);
+	columns[SECTION_LONGITUDE-1].Put(&entry.longitude, 4);
+	columns[SECTION_SPEED-1].Put(&entry.speed, 2);
+	columns[SECTION_HEADING-1].Put(&entry.heading, 2);
+	columns[SECTION_CONTACT_TIME-1].Put(&entry.contact_time, 4);
+}
+
+
+// Create a temporary cache file and write its header. Returns the descriptor, and the column writers in 'columns'.
+static int CreateCacheFile(string tempFile, string sourceFile, uint64_t entries, vector<CacheColumnWriter>* columns)
+{
+	CacheHeader header;
+	vector<CacheSection> sections;
+	LayoutCache(&header, &sections, entries, sourceFile);
+
+	int fd = open(tempFile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd < 0) { cout << "\nERROR\tFailed to open file for writing." << endl; exit(1); }
+
+	WriteFully(fd, &header, sizeof(header), 0);
+	WriteFully(fd, sections.data(), sections.size()*sizeof(CacheSection), sizeof(header));
+	if(ftruncate(fd, sections.back().offset + sections.back().bytes) != 0)
+		{ cout << "\nERROR\tFailed to write file." << endl; exit(1); }
+
+	for(uint32_t i = 0; i < sections.size(); i++)
+		columns->push_back( CacheColumnWriter(fd, sections[i].offset) );
+	return fd;
+}
+
+
+// Flush and close a temporary cache file, and move it into place.
+static void FinishCacheFile(int fd, vector<CacheColumnWriter>& columns, string tempFile, string cacheFile)
+{
+	for(uint32_t i = 0; i < columns.size(); i++)
+		columns[i].Flush();
+	if( (close(fd) != 0) or (rename(tempFile.c_str(), cacheFile.c_str()) != 0) )
+		{ unlink(tempFile.c_str()); cout << "\nERROR\tFailed to write dataset cache " << cacheFile << "." << endl; exit(1); }
+}
+
+
+void SaveDatabaseCache(string cacheFile, string sourceFile, const Dataset* database)
+{
+	// Write to a temporary file first, so concurrent runs never see a partial cache.
+	string tempFile = cacheFile + ".tmp" + to_string(getpid());
+	vector<CacheColumnWriter> columns;
+	int fd = CreateCacheFile(tempFile, sourceFile, database->size, &columns);
+
+	// The columns are already laid out as in the cache, write each one whole.
+	for(uint32_t id = SECTION_NODE_ID; id <= SECTION_CONTACT_TIME; id++)
+	{
+		WriteFully(fd, database->Column(id), database->size*g_cacheElementSize[id], columns[id-1].offset);
+		columns[id-1].offset += database->size*g_cacheElementSize[id];
+	}
+
+	FinishCacheFile(fd, columns, tempFile, cacheFile);
+}
+
+
+
+void PublishDataset(string name, const Dataset* database, const FeatureSchema* schema)
+{
+	string schemaText = schema->ToString();
+
+	// Lay out the columns as in a cache, followed by the features and the schema.
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DATASET_CACHE_MAGIC, 4);
+	header.version = DATASET_CACHE_VERSION;
+	header.entries = database->size;
+	header.sectionCount = SECTION_SCHEMA;
+	header.headerBytes = sizeof(CacheHeader);
+
+	vector<CacheSection> sections(header.sectionCount);
+	uint64_t offset = sizeof(CacheHeader) + header.sectionCount*sizeof(CacheSection);
+	for(uint32_t i = 0; i < header.sectionCount; i++)
+	{
+		uint32_t id = i+1;
+		offset = (offset + DATASET_CACHE_ALIGN-1) / DATASET_CACHE_ALIGN * DATASET_CACHE_ALIGN;
+		sections[i].id = id;
+		if(id <= SECTION_CONTACT_TIME)		sections[i].elementSize = g_cacheElementSize[id];
+		else if(id == SECTION_FEATURES)		sections[i].elementSize = database->featureCount*sizeof(float);
+		else								sections[i].elementSize = 1;
+		sections[i].offset = offset;
+		sections[i].bytes = (id == SECTION_SCHEMA) ? schemaText.size() : database->size*sections[i].elementSize;
+		offset += sections[i].bytes;
+	}
+
+	// Processes still attached to an older dataset keep their mapping.
+	string objectName = "/" + name;
+	shm_unlink(objectName.c_str());
+	int fd = shm_open(objectName.c_str(), O_RDWR|O_CREAT|O_EXCL, 0644);
+	if(fd < 0) { cout << "\nERROR\tFailed to create shared dataset " << name << "." << endl; exit(1); }
+	if(ftruncate(fd, offset) != 0)
+		{ shm_unlink(objectName.c_str()); cout << "\nERROR\tFailed to size shared dataset " << name << "." << endl; exit(1); }
+
+	for(uint32_t id = SECTION_NODE_ID; id <= SECTION_CONTACT_TIME; id++)
+		WriteFully(fd, database->Column(id), sections[id-1].bytes, sections[id-1].offset);
+	WriteFully(fd, database->features, sections[SECTION_FEATURES-1].bytes, sections[SECTION_FEATURES-1].offset);
+	WriteFully(fd, schemaText.data(), schemaText.size(), sections[SECTION_SCHEMA-1].offset);
+
+	// The header goes in last, so a dataset is never attached half-written.
+	WriteFully(fd, sections.data(), sections.size()*sizeof(CacheSection), sizeof(header));
+	WriteFully(fd, &header, sizeof(header), 0);
+	close(fd);
+}
+
+
+bool AttachDataset(string name, Dataset* database, string* schema)
+{
+	string objectName = "/" + name;
+	int fd = shm_open(objectName.c_str(), O_RDONLY, 0);
+	if(fd < 0) return false;
+
+	struct stat fileStat;
+	if( (fstat(fd, &fileStat) != 0) or ((uint64_t)fileStat.st_size < sizeof(CacheHeader)) ) { close(fd); return false; }
+	uint64_t size = fileStat.st_size;
+	void* mapping = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) return false;
+
+	const char* base = (const char*)mapping;
+	const CacheHeader* header = (const CacheHeader*)base;
+	const CacheSection* sections = (const CacheSection*)(base + sizeof(CacheHeader));
+	uint64_t columnOffsets[SECTION_CONTACT_TIME+1];
+	bool valid = ValidateCache(header, sections, size, "", columnOffsets);
+
+	// Find the features and the schema.
+	const CacheSection* featureSection = 0;
+	const CacheSection* schemaSection = 0;
+	for(uint32_t i = 0; valid and (i < header->sectionCount); i++)
+		if(sections[i].offset + sections[i].bytes <= size)
+		{
+			if(sections[i].id == SECTION_FEATURES)		featureSection = &sections[i];
+			else if(sections[i].id == SECTION_SCHEMA)	schemaSection = &sections[i];
+		}
+
+	if( !valid or !featureSection or !schemaSection 
+		or (featureSection->elementSize == 0) or (featureSection->elementSize % sizeof(float) != 0)
+		or (featureSection->elementSize/sizeof(float) > DATASET_MAX_FEATURES)
+		or (featureSection->bytes != header->entries*featureSection->elementSize) )
+		{ munmap(mapping, size); return false; }
+
+	schema->assign(base + schemaSection->offset, schemaSection->bytes);
+	database->AssignMapping(mapping, size, header->entries, columnOffsets);
+	database->features = (const float*)(base + featureSection->offset);
+	database->featureCount = featureSection->elementSize/sizeof(float);
+	return true;
+}
+
+
+
+// Reads back one sorted run of entries from the run file, a buffer at a time.
+class CacheRunReader
+{
+public:
+	int fd;
+	uint64_t next, end;	// Entry indices in the run file
+	vector<DataEntry> buffer;
+	uint64_t position = 0;
+
+	CacheRunReader(int ffd, uint64_t first, uint64_t count) { fd = ffd; next = first; end = first+count; }
+
+	// Returns false when the run is exhausted.
+	bool Fill(void)
+	{
+		if(position < buffer.size()) return true;
+		if(next == end) return false;
+		buffer.resize( min<uint64_t>(4096, end-next) );
+		if(!ReadFully(fd, buffer.data(), buffer.size()*sizeof(DataEntry), next*sizeof(DataEntry)))
+			{ cout << "\nERROR\tFailed to read file." << endl; exit(1); }
+		next += buffer.size(); position = 0;
+		return true;
+	}
+
+	const DataEntry& Current(void) { return buffer[position]; }
+};
+
+
+// Orders run heads for the merge: smallest (node_id, time) first, then earliest run, so the merge is stable.
+struct CacheMergeHead
+{
+	uint16_t node_id;
+	uint32_t relative_time;
+	uint32_t run;
+
+	bool operator < (const CacheMergeHead& head) const
+	{
+		if(node_id != head.node_id) return node_id > head.node_id;
+		if(relative_time != head.relative_time) return relative_time > head.relative_time;
+		return run > head.run;
+	}
+};
+
+
+void BuildDatabaseCache(string cacheFile, string sourceFile, uint64_t runBytes, uint16_t threads)
+{
+	/* Sort a CSV of any size into a cache in bounded memory.
+	 * The CSV is parsed 'runBytes' at a time, and each piece is sorted and spilled to a run file.
+	 * The runs are then merged straight into the cache columns.
+	 */
+	uint64_t textSize = 0, sourceSize; int64_t sourceMtime;
+	if(!StatFile(sourceFile, &sourceSize, &sourceMtime)) { cout << "\nERROR\tFailed to open file." << endl; exit(1); }
+	const char* text = MapFile(sourceFile, &textSize);
+	if( (sourceSize > 0) and !text ) { cout << "\nERROR\tFailed to map file." << endl; exit(1); }
+	madvise((void*)text, textSize, MADV_SEQUENTIAL);
+
+	// The run file is unlinked right away, it only lives as long as its descriptor.
+	string runFile = cacheFile + ".runs" + to_string(getpid());
+	int runFd = open(runFile.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if(runFd < 0) { cout << "\nERROR\tFailed to open file for writing." << endl; exit(1); }
+	unlink(runFile.c_str());
+
+	vector< pair<uint64_t,uint64_t> > runs; // (first entry, count)
+	uint64_t totalEntries = 0;
+	const char* p = text;
+	const char* textEnd = text + textSize;
+	while(p < textEnd)
+	{
+		const char* pieceEnd = ( (uint64_t)(textEnd-p) > runBytes ) ? p + runBytes : textEnd;
+		const char* newline = (const char*)memchr(pieceEnd, '\n', textEnd-pieceEnd);
+		pieceEnd = newline ? newline+1 : textEnd;
+
+		vector<DataEntry> run;
+		ParseDatabaseCSVParallel(p, pieceEnd, &run, threads, text);
+		SortDatabase(&run, threads);
+
+		WriteFully(runFd, run.data(), run.size()*sizeof(DataEntry), totalEntries*sizeof(DataEntry));
+		runs.push_back( make_pair(totalEntries, (uint64_t)run.size()) );
+		totalEntries += run.size();
+		p = pieceEnd;
+	}
+	if(text) munmap((void*)text, textSize);
+
+	// Merge the runs into a temporary cache file.
+	string tempFile = cacheFile + ".tmp" + to_string(getpid());
+	vector<CacheColumnWriter> columns;
+	int fd = CreateCacheFile(tempFile, sourceFile, totalEntries, &columns);
+
+	vector<CacheRunReader> readers;
+	priority_queue<CacheMergeHead> heads;
+	for(uint32_t r = 0; r < runs.size(); r++)
+		readers.push_back( CacheRunReader(runFd, runs[r].first, runs[r].second) );
+	for(uint32_t r = 0; r < readers.size(); r++)
+		if(readers[r].Fill())
+		{
+			CacheMergeHead head = { readers[r].Current().node_id, readers[r].Current().relative_time, r };
+			heads.push(head);
+		}
+
+	while(!heads.empty())
+	{
+		uint32_t r = heads.top().run;
+		heads.pop();
+
+		WriteCacheEntry(columns, readers[r].Current());
+		readers[r].position++;
+
+		if(readers[r].Fill())
+		{
+			CacheMergeHead head = { readers[r].Current().node_id, readers[r].Current().relative_time, r };
+			heads.push(head);
+		}
+	}
+
+	close(runFd);
+	FinishCacheFile(fd, columns, tempFile, cacheFile);
+}
+
+
+
+Dataset::~Dataset()
+{
+	Release();
+}
+
+
+void Dataset::FreeStorage(void)
+{
+	if(storage)
+	{
+		if(mapped) munmap(storage, storageBytes);
+		else free(storage);
+	}
+	storage = 0; storageBytes = 0; mapped = false;
+	node_id = 0; relative_time = 0; latitude = 0; longitude = 0;
+	speed = 0; heading = 0; contact_time = 0;
+}
+
+
+void Dataset::FreeWeights(void)
+{
+	vector<uint32_t>().swap(weightStorage); weights = 0;
+	vector<double>().swap(targetMeanStorage); targetMeans = 0;
+	vector<double>().swap(targetSpreadStorage); targetSpreads = 0;
+}
+
+
+void Dataset::Release(void)
+{
+	FreeStorage();
+	size = 0;
+	segments.clear();
+	vector<float>().swap(featureStorage); features = 0; featureCount = 0;
+	FreeWeights();
+	vector<uint8_t>().swap(encoded); isEncoded = false; isEncodedWeighted = false;
+}
+
+
+float* Dataset::AllocateFeatures(uint16_t count)
+{
+	featureCount = count;
+	featureStorage.resize(size*count);
+	features = featureStorage.data();
+	return featureStorage.data();
+}
+
+
+// Point every column at 'base' plus its offset, by CacheSectionId.
+static void SetColumns(Dataset* data, char* base, const uint64_t* columnOffsets)
+{
+	data->node_id		= (uint16_t*)(base + columnOffsets[SECTION_NODE_ID]);
+	data->relative_time	= (uint32_t*)(base + columnOffsets[SECTION_RELATIVE_TIME]);
+	data->latitude		= (float*)(base + columnOffsets[SECTION_LATITUDE]);
+	data->longitude		= (float*)(base + columnOffsets[SECTION_LONGITUDE]);
+	data->speed			= (uint16_t*)(base + columnOffsets[SECTION_SPEED]);
+	data->heading		= (uint16_t*)(base + columnOffsets[SECTION_HEADING]);
+	data->contact_time	= (uint32_t*)(base + columnOffsets[SECTION_CONTACT_TIME]);
+}
+
+
+// Value of entry 'i' in a column, as a double.
+static inline double ColumnValue(const Dataset* data, uint32_t column, uint64_t i)
+{
+	switch(column)
+	{
+		case SECTION_NODE_ID:		return data->node_id[i];
+		case SECTION_RELATIVE_TIME:	return data->relative_time[i];
+		case SECTION_LATITUDE:		return data->latitude[i];
+		case SECTION_LONGITUDE:		return data->longitude[i];
+		case SECTION_SPEED:			return data->speed[i];
+		case SECTION_HEADING:		return data->heading[i];
+		default:					return data->contact_time[i];
+	}
+}
+
+
+void Dataset::Allocate(uint64_t entries)
+{
+	// Lay out the columns one after the other, each aligned.
+	uint64_t columnOffsets[SECTION_CONTACT_TIME+1] = {0};
+	uint64_t bytes = 0;
+	for(uint32_t id = SECTION_NODE_ID; id <= SECTION_CONTACT_TIME; id++)
+	{
+		columnOffsets[id] = bytes;
+		bytes += (entries*g_cacheElementSize[id] + DATASET_CACHE_ALIGN-1) / DATASET_CACHE_ALIGN * DATASET_CACHE_ALIGN;
+	}
+
+	if( mapped or (bytes > storageBytes) )
+	{
+		Release();
+		if(bytes > 0)
+		{
+			storage = aligned_alloc(DATASET_CACHE_ALIGN, bytes);
+			if(!storage) { cout << "\nERROR\tOut of memory." << endl; exit(1); }
+			storageBytes = bytes;
+		}
+	}
+
+	size = entries;
+	if(storage) SetColumns(this, (char*)storage, columnOffsets);
+	FreeWeights();
+	vector<uint8_t>().swap(encoded); isEncoded = false; isEncodedWeighted = false;
+}
+
+
+void Dataset::Assign(const vector<DataEntry>& entries)
+{
+	Allocate(entries.size());
+	for(uint64_t i = 0; i < size; i++)
+	{
+		node_id[i]			= entries[i].node_id;
+		relative_time[i]	= entries[i].relative_time;
+		latitude[i]			= entries[i].latitude;
+		longitude[i]		= entries[i].longitude;
+		speed[i]			= entries[i].speed;
+		heading[i]			= entries[i].heading;
+		contact_time[i]		= entries[i].contact_time;
+	}
+	IndexSegments();
+}
+
+
+void Dataset::AssignMapping(void* mapping, uint64_t mappingBytes, uint64_t entries, const uint64_t* columnOffsets)
+{
+	Release();
+	storage = mapping; storageBytes = mappingBytes; mapped = true;
+	size = entries;
+	SetColumns(this, (char*)mapping, columnOffsets);
+	IndexSegments();
+}
+
+
+void* Dataset::Column(uint32_t section) const
+{
+	switch(section)
+	{
+		case SECTION_NODE_ID:		return node_id;
+		case SECTION_RELATIVE_TIME:	return relative_time;
+		case SECTION_LATITUDE:		return latitude;
+		case SECTION_LONGITUDE:		return longitude;
+		case SECTION_SPEED:			return speed;
+		case SECTION_HEADING:		return heading;
+		case SECTION_CONTACT_TIME:	return contact_time;
+		default:					return 0;
+	}
+}
+
+
+// Append the zigzag varint of the difference between two 32-bit values.
+static inline void PutDelta(vector<uint8_t>* out, uint32_t value, uint32_t previous)
+{
+	int32_t delta = (int32_t)(value - previous);
+	uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+	while(zigzag >= 0x80) { out->push_back( (zigzag & 0x7F) | 0x80 ); zigzag >>= 7; }
+	out->push_back(zigzag);
+}
+
+
+void Dataset::Encode(void)
+{
+	encoded.clear();
+	isEncodedWeighted = (weights != 0);
+	uint16_t valueCount = featureCount + (isEncodedWeighted ? 6 : 1);
+	vector<uint32_t> previous(valueCount);
+	uint32_t targetWords[4];
+
+	for(vector<DatasetSegment>::iterator
+		iterSegment = segments.begin();
+		iterSegment != segments.end();
+		iterSegment++)
+	{
+		iterSegment->encodedOffset = encoded.size();
+		previous.assign(valueCount, 0);
+		if(isEncodedWeighted) previous[featureCount+1] = 1;
+		for(uint64_t i = iterSegment->begin; i < iterSegment->end; i++)
+		{
+			if(isEncodedWeighted)
+			{
+				memcpy(&targetWords[0], &targetMeans[i], sizeof(double));
+				memcpy(&targetWords[2], &targetSpreads[i], sizeof(double));
+			}
+			for(uint16_t f = 0; f < valueCount; f++)
+			{
+				uint32_t value;
+				if(f < featureCount)			memcpy(&value, &features[i*featureCount + f], sizeof(value));
+				else if(f == featureCount)		value = contact_time[i];
+				else if(f == featureCount+1)	value = weights[i];
+				else							value = targetWords[f - featureCount-2];
+				PutDelta(&encoded, value, previous[f]);
+				previous[f] = value;
+			}
+		}
+	}
+	encoded.shrink_to_fit();
+	isEncoded = true;
+
+	// Only the encoded form is used from now on.
+	FreeStorage();
+	vector<float>().swap(featureStorage); features = 0;
+	FreeWeights();
+}
+
+
+/* Add the samples of an entry ('weight', with targets of 'mean' and 'spread') to a run of samples.
+ * Pairwise update of the mean and of the sum of squared differences to it (Chan et al.), so merging 
+ * runs of any length keeps the spread exact.
+ */
+static inline void MergeTargets(uint32_t* runWeight, double* runMean, double* runSpread, uint32_t weight, double mean, double spread)
+{
+	double delta = mean - *runMean;
+	uint32_t total = *runWeight + weight;
+	*runSpread += spread + delta*delta*(*runWeight)*weight/total;
+	*runMean += delta*weight/total;
+	*runWeight = total;
+}
+
+
+uint64_t Dataset::Compact(const CompactionTolerances& tolerances)
+{
+	// Pick the first sample of every run, and count the samples it stands for, with their targets.
+	vector<uint64_t> rows;
+	vector<uint32_t> rowWeights;
+	vector<double> rowMeans, rowSpreads;
+	for(vector<DatasetSegment>::const_iterator
+		iterSegment = segments.begin();
+		iterSegment != segments.end();
+		iterSegment++)
+	{
+		uint64_t anchor = iterSegment->begin;
+		for(uint64_t i = iterSegment->begin; i < iterSegment->end; i++)
+		{
+			bool redundant = (i > anchor);
+			for(uint32_t id = SECTION_RELATIVE_TIME; redundant and (id <= SECTION_HEADING); id++)
+				if( (tolerances.tolerance[id] >= 0)
+					and (fabs(ColumnValue(this, id, i) - ColumnValue(this, id, anchor)) > tolerances.tolerance[id]) )
+					redundant = false;
+
+			uint32_t weight = weights ? weights[i] : 1;
+			double mean = targetMeans ? targetMeans[i] : contact_time[i];
+			double spread = targetSpreads ? targetSpreads[i] : 0;
+			if(redundant)
+				MergeTargets(&rowWeights.back(), &rowMeans.back(), &rowSpreads.back(), weight, mean, spread);
+			else
+			{
+				anchor = i; rows.push_back(i); 
+				rowWeights.push_back(weight); rowMeans.push_back(mean); rowSpreads.push_back(spread);
+			}
+		}
+	}
+
+	uint64_t removed = size - rows.size();
+	if(removed == 0) return 0;
+
+	// Gather the kept rows into new storage, then take it over.
+	Dataset compacted;
+	compacted.Gather(this, rows, &rowWeights, &rowMeans, &rowSpreads);
+	Swap(&compacted);
+	return removed;
+}
+
+
+void Dataset::Decimate(const Dataset* source, uint32_t factor)
+{
+	// Keep every factor-th sample of each vehicle, standing for the samples up to the next one kept.
+	vector<uint64_t> rows;
+	vector<uint32_t> rowWeights;
+	vector<double> rowMeans, rowSpreads;
+	for(vector<DatasetSegment>::const_iterator
+		iterSegment = source->segments.begin();
+		iterSegment != source->segments.end();
+		iterSegment++)
+		for(uint64_t i = iterSegment->begin; i < iterSegment->end; i++)
+		{
+			uint32_t weight = source->weights ? source->weights[i] : 1;
+			double mean = source->targetMeans ? source->targetMeans[i] : source->contact_time[i];
+			double spread = source->targetSpreads ? source->targetSpreads[i] : 0;
+			if( (i - iterSegment->begin) % factor == 0 )
+				{ rows.push_back(i); rowWeights.push_back(weight); rowMeans.push_back(mean); rowSpreads.push_back(spread); }
+			else
+				MergeTargets(&rowWeights.back(), &rowMeans.back(), &rowSpreads.back(), weight, mean, spread);
+		}
+
+	Gather(source, rows, &rowWeights, &rowMeans, &rowSpreads);
+}
+
+
+void Dataset::Gather(const Dataset* source, const vector<uint64_t>& rows, 
+	vector<uint32_t>* rowWeights, vector<double>* rowMeans, vector<double>* rowSpreads)
+{
+	Allocate(rows.size());
+	for(uint32_t id = SECTION_NODE_ID; id <= SECTION_CONTACT_TIME; id++)
+	{
+		uint32_t elementSize = g_cacheElementSize[id];
+		const char* from = (const char*)source->Column(id);
+		char* to = (char*)Column(id);
+		for(uint64_t r = 0; r < rows.size(); r++)
+			memcpy(to + r*elementSize, from + rows[r]*elementSize, elementSize);
+	}
+
+	uint16_t count = source->featureCount;
+	float* matrix = AllocateFeatures(count);
+	for(uint64_t r = 0; r < rows.size(); r++)
+		memcpy(matrix + r*count, source->features + rows[r]*count, count*sizeof(float));
+
+	weightStorage.swap(*rowWeights);
+	weights = weightStorage.data();
+	targetMeanStorage.swap(*rowMeans);
+	targetMeans = targetMeanStorage.data();
+	targetSpreadStorage.swap(*rowSpreads);
+	targetSpreads = targetSpreadStorage.data();
+
+	// Rows keep the trips of the source: once thinned out, a vehicle's samples may be further
+	// apart than the trip gap without starting a new trip.
+	segments.clear();
+	size_t s = 0;
+	for(uint64_t r = 0; r < rows.size(); r++)
+	{
+		bool newTrip = (r == 0);
+		while(rows[r] >= source->segments[s].end)
+			{ s++; newTrip = true; }
+		if(newTrip)
+		{
+			if(!segments.empty()) segments.back().end = r;
+			DatasetSegment segment = { r, rows.size(), source->segments[s].node_id, 0 };
+			segments.push_back(segment);
+		}
+	}
+}
+
+
+void Dataset::Swap(Dataset* other)
+{
+	swap(size, other->size);
+	swap(node_id, other->node_id); swap(relative_time, other->relative_time);
+	swap(latitude, other->latitude); swap(longitude, other->longitude);
+	swap(speed, other->speed); swap(heading, other->heading); swap(contact_time, other->contact_time);
+	segments.swap(other->segments);
+	swap(features, other->features); swap(featureCount, other->featureCount); featureStorage.swap(other->featureStorage);
+	swap(weights, other->weights); weightStorage.swap(other->weightStorage);
+	swap(targetMeans, other->targetMeans); targetMeanStorage.swap(other->targetMeanStorage);
+	swap(targetSpreads, other->targetSpreads); targetSpreadStorage.swap(other->targetSpreadStorage);
+	encoded.swap(other->encoded); swap(isEncoded, other->isEncoded); swap(isEncodedWeighted, other->isEncodedWeighted);
+	swap(storage, other->storage); swap(storageBytes, other->storageBytes); swap(mapped, other->mapped);
+}
+
+
+void Dataset::IndexSegments(void)
+{
+	segments.clear();
+	uint64_t begin = 0;
+	for(uint64_t i = 1; i <= size; i++)
+		if( (i == size) or (node_id[i] != node_id[begin]) 
+			or ( g_tripGap and (relative_time[i] > relative_time[i-1] + g_tripGap) ) )
+		{
+			DatasetSegment segment = { begin, i, node_id[begin], 0 };
+			segments.push_back(segment);
+			begin = i;
+		}
+}
+
+
+
+bool DatabaseFollower::Open(string ppath)
+{
+	struct stat pathStat;
+	if(stat(ppath.c_str(), &pathStat) != 0) return false;
+	path = ppath;
+	directory = S_ISDIR(pathStat.st_mode);
+	files.clear();
+	return true;
+}
+
+
+uint64_t DatabaseFollower::PollFile(string filename, vector<DataEntry>* database, uint16_t threads)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0) return 0;
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) != 0) { close(fd); return 0; }
+
+	// A file replaced under the same name (rotated, say), or that shrank, is read from the start.
+	FollowedFile& file = files[filename];
+	uint64_t size = fileStat.st_size;
+	if( (fileStat.st_dev != file.device) or (fileStat.st_ino != file.inode) or (size < file.offset) )
+		{ file.offset = 0; file.device = fileStat.st_dev; file.inode = fileStat.st_ino; }
+	uint64_t& offset = file.offset;
+	if(size == offset) { close(fd); return 0; }
+
+	vector<char> tail(size-offset);
+	bool readOk = ReadFully(fd, tail.data(), tail.size(), offset);
+	close(fd);
+	if(!readOk) return 0;
+
+	// Only parse complete lines, a partly written line is picked up by the next poll.
+	const char* text = tail.data();
+	const char* lastNewline = (const char*)memrchr(text, '\n', tail.size());
+	if(!lastNewline) return 0;
+	uint64_t parsed = lastNewline+1 - text;
+
+	// A malformed line must not stop a run that is meant to keep going: it is left out, and reported.
+	uint64_t skipped = 0;
+	ParseDatabaseCSVParallel(text, text+parsed, database, threads, text, &skipped);
+	if(skipped)
+		cout << "INFO\tSkipped " << skipped << " malformed lines in " << filename << "." << endl;
+	offset += parsed;
+	return parsed;
+}
+
+
+uint64_t DatabaseFollower::Poll(vector<DataEntry>* database, uint16_t threads)
+{
+	if(!directory)
+		return PollFile(path, database, threads);
+
+	// Spool directory: every visible regular file, in name order.
+	vector<string> filenames;
+	DIR* dir = opendir(path.c_str());
+	if(!dir) return 0;
+	while(struct dirent* dirEntry = readdir(dir))
+	{
+		string name = dirEntry->d_name;
+		struct stat fileStat;
+		if( (name[0] != '.') and (stat((path + "/" + name).c_str(), &fileStat) == 0) and S_ISREG(fileStat.st_mode) )
+			filenames.push_back(path + "/" + name);
+	}
+	closedir(dir);
+	sort(filenames.begin(), filenames.end());
+
+	uint64_t parsed = 0;
+	for(uint32_t f = 0; f < filenames.size(); f++)
+		parsed += PollFile(filenames[f], database, threads);
+	return parsed;
+}
+
+
+void SetTripGap(uint32_t seconds)
+{
+	g_tripGap = seconds;
+}
+
+
+uint64_t SlideDatabaseWindow(vector<DataEntry>* database, uint32_t maxVehicles, uint32_t maxSeconds, uint64_t maxEntries)
+{
+	uint64_t entries = database->size();
+
+	// Drop entries older than the time horizon, counted back from the latest.
+	if( maxSeconds and !database->empty() )
+	{
+		uint32_t latest = 0;
+		for(vector<DataEntry>::const_iterator
+			iterDB = database->begin();
+			iterDB != database->end();
+			iterDB++)
+			latest = max(latest, iterDB->relative_time);
+		if(latest > maxSeconds)
+		{
+			uint32_t oldest = latest - maxSeconds;
+			database->erase(remove_if(database->begin(), database->end(),
+				[oldest](const DataEntry& entry) { return entry.relative_time < oldest; }), database->end());
+		}
+	}
+
+	// Then the oldest entries past the cap. Entries sharing the time at the cap are all kept.
+	if( maxEntries and (database->size() > maxEntries) )
+	{
+		vector<uint32_t> times(database->size());
+		for(uint64_t i = 0; i < database->size(); i++)
+			times[i] = (*database)[i].relative_time;
+		nth_element(times.begin(), times.begin() + (times.size() - maxEntries), times.end());
+		uint32_t oldest = times[times.size() - maxEntries];
+		database->erase(remove_if(database->begin(), database->end(),
+			[oldest](const DataEntry& entry) { return entry.relative_time < oldest; }), database->end());
+	}
+
+	// Latest time seen per vehicle.
+	map<uint16_t,uint32_t> lastSeen;
+	for(vector<DataEntry>::const_iterator
+		iterDB = database->begin();
+		iterDB != database->end();
+		iterDB++)
+	{
+		uint32_t& last = lastSeen[iterDB->node_id];
+		last = max(last, iterDB->relative_time);
+	}
+	if(lastSeen.size() <= maxVehicles) return entries - database->size();
+
+	// Rank vehicles from most to least recent, and keep the first 'maxVehicles'.
+	vector< pair<uint32_t,uint16_t> > recency;
+	for(map<uint16_t,uint32_t>::const_iterator
+		iterSeen = lastSeen.begin();
+		iterSeen != lastSeen.end();
+		iterSeen++)
+		recency.push_back( make_pair(iterSeen->second, iterSeen->first) );
+	sort(recency.rbegin(), recency.rend());
+
+	vector<bool> keep(UINT16_MAX+1, false);
+	for(uint32_t v = 0; v < maxVehicles; v++)
+		keep[recency[v].second] = true;
+
+	vector<DataEntry>::iterator kept = remove_if(database->begin(), database->end(),
+		[&keep](const DataEntry& entry) { return !keep[entry.node_id]; });
+	database->erase(kept, database->end());
+	return entries - database->size();
+}
+
+
+void SampleDataset(const Dataset* data, double fraction, uint64_t seed, DatasetSample* sample)
+{
+	sample->segments.clear();
+	sample->entries = 0;
+
+	for(vector<DatasetSegment>::const_iterator
+		iterSegment = data->segments.begin();
+		iterSegment != data->segments.end();
+		iterSegment++)
+	{
+		// Mix the node_id with the seed (splitmix64), and keep the top 53 bits as a uniform draw in [0,1).
+		uint64_t hash = seed + 0x9E3779B97F4A7C15ULL*(1 + iterSegment->node_id);
+		hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+		hash ^= hash >> 31;
+
+		if( (hash >> 11) * (1.0/9007199254740992.0) < fraction )
+		{
+			sample->segments.push_back(*iterSegment);
+			sample->entries += iterSegment->end - iterSegment->begin;
+		}
+	}
+}
+
+
+
+// Input column names, by CacheSectionId, and the node names they get by default.
+static const char* g_columnNames[SECTION_HEADING+1] = { "", "node_id", "relative_time", "latitude", "longitude", "speed", "heading" };
+static const char* g_columnNodeNames[SECTION_HEADING+1] = { "", "id", "time", "lat", "lon", "speed", "bearing" };
+
+
+// Value of a feature on entry 'i' of 'segment', before scaling.
+static inline double FeatureValue(const FeatureSpec& feature, const Dataset* data, const DatasetSegment& segment, uint64_t i)
+{
+	double value = ColumnValue(data, feature.column, i);
+	if(feature.delta)
+		value = (i == segment.begin) ? 0.0 : value - ColumnValue(data, feature.column, i-1);
+	return value;
+}
+
+
+CompactionTolerances::CompactionTolerances()
+{
+	for(uint32_t id = 0; id <= SECTION_HEADING; id++)
+		tolerance[id] = 0;
+	tolerance[SECTION_NODE_ID] = -1;
+	tolerance[SECTION_RELATIVE_TIME] = -1;
+}
+
+
+void CompactionTolerances::Parse(string text)
+{
+	stringstream items(text);
+	string item;
+	while(getline(items, item, ','))
+	{
+		if(item.empty()) continue;
+
+		size_t equals = item.find('=');
+		string name = item.substr(0, equals);
+		uint32_t column = 0;
+		for(uint32_t id = SECTION_RELATIVE_TIME; id <= SECTION_HEADING; id++)
+			if(name == g_columnNames[id]) column = id;
+		if(name == "contact_time")
+			{ cout << "\nERROR\tcontact_time is the target: merged samples keep every one of theirs, so it is never compared." << endl; exit(1); }
+		if(!column)
+			{ cout << "\nERROR\tUnknown compaction column '" << name << "'." << endl; exit(1); }
+
+		char* end;
+		const char* value = (equals == string::npos) ? "" : item.c_str() + equals+1;
+		tolerance[column] = strtod(value, &end);
+		if( (*end != '\0') or (end == value) )
+			{ cout << "\nERROR\tMalformed tolerance in '" << item << "'." << endl; exit(1); }
+	}
+}
+
+
+void FeatureSchema::Parse(string text)
+{
+	features.clear();
+
+	stringstream items(text);
+	string item;
+	while(getline(items, item, ','))
+	{
+		if(item.empty()) continue;
+
+		stringstream parts(item);
+		string part;
+		getline(parts, part, ':');
+
+		FeatureSpec feature;
+		feature.column = 0;
+		for(uint32_t id = SECTION_NODE_ID; id <= SECTION_HEADING; id++)
+			if(part == g_columnNames[id]) feature.column = id;
+		if(!feature.column)
+			{ cout << "\nERROR\tUnknown input column '" << part << "'." << endl; exit(1); }
+		feature.name = g_columnNodeNames[feature.column];
+
+		while(getline(parts, part, ':'))
+		{
+			if(part == "delta")					{ feature.delta = true; feature.name = "d" + feature.name; }
+			else if(part == "zscore")			feature.scaling = FeatureScaling::ZSCORE;
+			else if(part == "minmax")			feature.scaling = FeatureScaling::MINMAX;
+			else if(part.compare(0,6,"scale=") == 0)
+			{
+				char* end;
+				feature.scaling = FeatureScaling::SCALE;
+				feature.scale = strtod(part.c_str()+6, &end);
+				if( (*end != '\0') or (end == part.c_str()+6) )
+					{ cout << "\nERROR\tMalformed scale in input '" << item << "'." << endl; exit(1); }
+			}
+			else if(part.compare(0,7,"offset=") == 0)
+			{
+				char* end;
+				if(feature.scaling == FeatureScaling::NONE) feature.scaling = FeatureScaling::SCALE;
+				feature.offset = strtod(part.c_str()+7, &end);
+				if( (*end != '\0') or (end == part.c_str()+7) )
+					{ cout << "\nERROR\tMalformed offset in input '" << item << "'." << endl; exit(1); }
+			}
+			else if(part.compare(0,3,"as=") == 0)	feature.name = part.substr(3);
+			else
+				{ cout << "\nERROR\tUnknown transform '" << part << "' in input '" << item << "'." << endl; exit(1); }
+		}
+
+		features.push_back(feature);
+	}
+
+	if(features.empty())
+		{ cout << "\nERROR\tThe input schema has no inputs." << endl; exit(1); }
+	if(features.size() > DATASET_MAX_FEATURES)
+		{ cout << "\nERROR\tThe input schema has more than " << DATASET_MAX_FEATURES << " inputs." << endl; exit(1); }
+}
+
+
+void FeatureSchema::ResetStatistics(void)
+{
+	for(vector<FeatureSpec>::iterator
+		iterFeature = features.begin();
+		iterFeature != features.end();
+		iterFeature++)
+	{
+		iterFeature->count = 0; iterFeature->sum = 0; iterFeature->sumSquares = 0;
+		iterFeature->minimum = DBL_MAX; iterFeature->maximum = -DBL_MAX;
+	}
+}
+
+
+void FeatureSchema::Accumulate(const Dataset* data)
+{
+	for(vector<FeatureSpec>::iterator
+		iterFeature = features.begin();
+		iterFeature != features.end();
+		iterFeature++)
+	{
+		if( (iterFeature->scaling != FeatureScaling::ZSCORE) and (iterFeature->scaling != FeatureScaling::MINMAX) )
+			continue;
+
+		for(vector<DatasetSegment>::const_iterator
+			iterSegment = data->segments.begin();
+			iterSegment != data->segments.end();
+			iterSegment++)
+			for(uint64_t i = iterSegment->begin; i < iterSegment->end; i++)
+			{
+				double value = FeatureValue(*iterFeature, data, *iterSegment, i);
+				iterFeature->count++;
+				iterFeature->sum += value;
+				iterFeature->sumSquares += value*value;
+				iterFeature->minimum = min(iterFeature->minimum, value);
+				iterFeature->maximum = max(iterFeature->maximum, value);
+			}
+	}
+}
+
+
+void FeatureSchema::FinishFit(void)
+{
+	for(vector<FeatureSpec>::iterator
+		iterFeature = features.begin();
+		iterFeature != features.end();
+		iterFeature++)
+	{
+		if(iterFeature->count == 0) continue;
+
+		if(iterFeature->scaling == FeatureScaling::ZSCORE)
+		{
+			double mean = iterFeature->sum/iterFeature->count;
+			double variance = iterFeature->sumSquares/iterFeature->count - mean*mean;
+			iterFeature->offset = mean;
+			iterFeature->scale = (variance > 0) ? 1.0/sqrt(variance) : 1.0;
+		}
+		else if(iterFeature->scaling == FeatureScaling::MINMAX)
+		{
+			double range = iterFeature->maximum - iterFeature->minimum;
+			iterFeature->offset = iterFeature->minimum;
+			iterFeature->scale = (range > 0) ? 1.0/range : 1.0;
+		}
+	}
+}
+
+
+void FeatureSchema::Fit(const Dataset* data)
+{
+	ResetStatistics();
+	Accumulate(data);
+	FinishFit();
+}
+
+
+void FeatureSchema::Fit(DatabaseStream* stream)
+{
+	// Only take a pass over the stream if some feature needs it.
+	bool needed = false;
+	for(uint16_t f = 0; f < features.size(); f++)
+		if( (features[f].scaling == FeatureScaling::ZSCORE) or (features[f].scaling == FeatureScaling::MINMAX) )
+			needed = true;
+	if(!needed) return;
+
+	ResetStatistics();
+	Dataset block;
+	stream->Rewind();
+	while(stream->NextBlock(&block))
+		Accumulate(&block);
+	stream->Rewind();
+	FinishFit();
+}
+
+
+void FeatureSchema::Apply(Dataset* data) const
+{
+	float* matrix = data->AllocateFeatures(features.size());
+
+	for(vector<DatasetSegment>::const_iterator
+		iterSegment = data->segments.begin();
+		iterSegment != data->segments.end();
+		iterSegment++)
+		for(uint64_t i = iterSegment->begin; i < iterSegment->end; i++)
+		{
+			float* row = &matrix[i*data->featureCount];
+			for(uint16_t f = 0; f < features.size(); f++)
+			{
+				const FeatureSpec& feature = features[f];
+				double value = FeatureValue(feature, data, *iterSegment, i);
+				if(feature.scaling != FeatureScaling::NONE)
+					value = (value - feature.offset) * feature.scale;
+				row[f] = value;
+			}
+		}
+}
+
+
+string FeatureSchema::ToString(void) const
+{
+	stringstream text;
+	text << setprecision(17);
+	for(uint16_t f = 0; f < features.size(); f++)
+	{
+		const FeatureSpec& feature = features[f];
+		if(f) text << ',';
+		text << g_columnNames[feature.column];
+		if(feature.delta) text << ":delta";
+		if(feature.scaling != FeatureScaling::NONE)
+			text << ":scale=" << feature.scale << ":offset=" << feature.offset;
+		text << ":as=" << feature.name;
+	}
+	return text.str();
+}
+
+
+void FeatureSchema::Print(ostream& outstream) const
+{
+	for(uint16_t f = 0; f < features.size(); f++)
+	{
+		const FeatureSpec& feature = features[f];
+		outstream << "INFO\tInput " << f+1 << ": " << feature.name << " = "
+				  << (feature.delta ? "delta " : "") << g_columnNames[feature.column];
+		if(feature.scaling != FeatureScaling::NONE)
+			outstream << ", scaled as (x - " << feature.offset << ") * " << feature.scale;
+		outstream << '\n';
+	}
+}
+
+
+
+DatabaseLoadStats StreamDatabase(string filename, DatabaseStream* stream, uint64_t blockBytes, uint16_t threads)
+{
+	DatabaseLoadStats stats;
+	chrono::steady_clock::time_point loadStart = chrono::steady_clock::now();
+
+	string cacheFile = filename + ".nrsu";
+	if(!stream->Open(cacheFile, filename, blockBytes))
+	{
+		BuildDatabaseCache(cacheFile, filename, blockBytes, threads);
+		stats.cacheWritten = true;
+		if(!stream->Open(cacheFile, filename, blockBytes))
+			{ cout << "\nERROR\tFailed to open dataset cache " << cacheFile << "." << endl; exit(1); }
+	}
+	stats.fromCache = true;
+	stats.bytes = stream->bytes;
+
+	stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+	return stats;
+}
+
+
+
+DatabaseStream::~DatabaseStream()
+{
+	if(fd >= 0) close(fd);
+}
+
+
+bool DatabaseStream::Open(string cacheFile, string sourceFile, uint64_t blockBytes)
+{
+	if(fd >= 0) close(fd);
+	fd = open(cacheFile.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+
+	struct stat fileStat;
+	CacheHeader header;
+	if( (fstat(fd, &fileStat) != 0) or !ReadFully(fd, &header, sizeof(header), 0) or (header.sectionCount > 64) )
+		{ close(fd); fd = -1; return false; }
+
+	vector<CacheSection> sections(header.sectionCount);
+	if( !ReadFully(fd, sections.data(), sections.size()*sizeof(CacheSection), sizeof(header))
+		or !ValidateCache(&header, sections.data(), fileStat.st_size, sourceFile, columnOffsets) )
+		{ close(fd); fd = -1; return false; }
+
+	entries = header.entries;
+	bytes = fileStat.st_size;
+	blockEntries = max<uint64_t>(1, blockBytes/CacheEntryBytes());
+	position = 0;
+	return true;
+}
+
+
+void DatabaseStream::Rewind(void)
+{
+	position = 0;
+}
+
+
+void DatabaseStream::ReadColumn(uint32_t section, uint64_t first, uint64_t count, void* out)
+{
+	uint32_t elementSize = g_cacheElementSize[section];
+	if(!ReadFully(fd, out, count*elementSize, columnOffsets[section] + first*elementSize))
+		{ cout << "\nERROR\tFailed to read the dataset cache." << endl; exit(1); }
+}
+
+
+bool DatabaseStream::NextBlock(Dataset* block)
+{
+	if(position >= entries) { block->Allocate(0); return false; }
+
+	// Read the node IDs first, to find where the block should end.
+	uint64_t count = min(blockEntries, entries-position);
+	ids.resize(count+1);
+	ReadColumn(SECTION_NODE_ID, position, count, ids.data());
+
+	if(position+count < entries)
+	{
+		// Never split a vehicle. End the block where its last vehicle starts, unless
+		// that vehicle continues past the block.
+		uint16_t lastId = ids[count-1];
+		uint64_t vehicleStart = count-1;
+		while( (vehicleStart > 0) and (ids[vehicleStart-1] == lastId) ) vehicleStart--;
+
+		ReadColumn(SECTION_NODE_ID, position+count, 1, &ids[count]);
+		if(ids[count] == lastId)
+		{
+			if(vehicleStart > 0)
+				count = vehicleStart;
+			else
+			{
+				// A single vehicle is larger than a block: extend the block to its end.
+				while(position+count < entries)
+				{
+					uint64_t chunk = min(blockEntries, entries-position-count);
+					ids.resize(chunk);
+					ReadColumn(SECTION_NODE_ID, position+count, chunk, ids.data());
+					uint64_t k = 0;
+					while( (k < chunk) and (ids[k] == lastId) ) k++;
+					count += k;
+					if(k < chunk) break;
+				}
+			}
+		}
+	}
+
+	// Read every column for the block straight into place.
+	block->Allocate(count);
+	for(uint32_t id = SECTION_NODE_ID; id <= SECTION_CONTACT_TIME; id++)
+		ReadColumn(id, position, count, block->Column(id));
+	block->IndexSegments();
+	if(schema) schema->Apply(block);
+
+	position += count;
+	return true;
+}
+
+
+
+void *ThreadLoadDatabase(void *threadarg)
+{
+	threadDataLoadDatabase* load = (threadDataLoadDatabase *) threadarg;
+	load->stats = LoadDatabase(load->filename, load->database, load->useCache, load->threads);
+	pthread_exit(NULL);
+}
@@ -3,9 +3,23 @@
 
  #include "genetic.h"
 
+#include <unistd.h>
+#include <unordered_map>
+
 uint16_t g_innovations = 0;
 map<pair<uint16_t,uint16_t>,uint16_t> g_innovationList; 
 
+// By phenotype hash: the error, and the last generation the network was seen in.
+static unordered_map<uint64_t, pair<double,uint32_t> > g_fitnessCache;
+static pthread_mutex_t g_fitnessCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_fitnessCacheLookups = 0;
+static uint64_t g_fitnessCacheHits = 0;
+
+static pthread_mutex_t g_batchLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_batchGenomes = 0;
+static uint64_t g_batchBatched = 0;
+static uint64_t g_batchBatches = 0;
+
 
 double ActivationSigmoid (double input)
 {
@@ -23,6 +37,38 @@ double ActivationMatlabTanSig (double input)
 }
 
 
+/* Rational approximation of tanh(), Padé [9/8], clamped where it meets 1, in place. Every
+ * operation is elementwise, so it also works on vectors of floats.
+ */
+template<typename Values>
+static inline __attribute__((always_inline)) void FastTanh (Values* value)
+{
+	const float limit = 6.15f;
+	Values x = *value < -limit ? -limit : *value;
+	x = x > limit ? limit : x;
+	Values x2 = x*x;
+	*value = x*(34459425.0f + x2*(4729725.0f + x2*(135135.0f + x2*(990.0f + x2))))
+			/ (34459425.0f + x2*(16216200.0f + x2*(945945.0f + x2*(13860.0f + 45.0f*x2))));
+}
+
+
+float ActivationSigmoidFast (float input)
+{
+	// 1/(1+exp(-2y)) is (1+tanh(y))/2.
+	float value = 2.45f*input;
+	FastTanh(&value);
+	return 0.5f + 0.5f*value;
+}
+
+
+float ActivationMatlabTanSigFast (float input)
+{
+	// tansig is tanh.
+	FastTanh(&input);
+	return input;
+}
+
+
 double ActivationOutput (double input)
 {
 	// Linear.
@@ -30,6 +76,75 @@ double ActivationOutput (double input)
 }
 
 
+double FitnessFromError (double sse)
+{
+	if( !boost::math::isfinite(sse) )
+		return 0;
+	return 1.0/(sse+1.0);
+}
+
+
+bool LookupFitnessCache(uint64_t hash, double* sse)
+{
+	pthread_mutex_lock(&g_fitnessCacheLock);
+	g_fitnessCacheLookups++;
+	unordered_map<uint64_t, pair<double,uint32_t> >::iterator iterCache = g_fitnessCache.find(hash);
+	bool hit = (iterCache != g_fitnessCache.end());
+	if(hit)
+		{ *sse = iterCache->second.first; iterCache->second.second = g_generationNumber; g_fitnessCacheHits++; }
+	pthread_mutex_unlock(&g_fitnessCacheLock);
+	return hit;
+}
+
+
+void StoreFitnessCache(uint64_t hash, double sse)
+{
+	pthread_mutex_lock(&g_fitnessCacheLock);
+	// Full: evict the networks no longer in the population. Only if a generation alone filled it, flush it.
+	if(g_fitnessCache.size() >= GENOME_FITNESS_CACHE_SIZE)
+	{
+		for(unordered_map<uint64_t, pair<double,uint32_t> >::iterator
+			iterCache = g_fitnessCache.begin();
+			iterCache != g_fitnessCache.end(); )
+			if(iterCache->second.second + 1 < g_generationNumber)
+				iterCache = g_fitnessCache.erase(iterCache);
+			else
+				iterCache++;
+		if(g_fitnessCache.size() >= GENOME_FITNESS_CACHE_SIZE)
+			g_fitnessCache.clear();
+	}
+	g_fitnessCache[hash] = make_pair(sse, g_generationNumber);
+	pthread_mutex_unlock(&g_fitnessCacheLock);
+}
+
+
+void ClearFitnessCache(void)
+{
+	pthread_mutex_lock(&g_fitnessCacheLock);
+	g_fitnessCache.clear();
+	pthread_mutex_unlock(&g_fitnessCacheLock);
+}
+
+
+void GetFitnessCacheStats(uint64_t* lookups, uint64_t* hits)
+{
+	pthread_mutex_lock(&g_fitnessCacheLock);
+	*lookups = g_fitnessCacheLookups;
+	*hits = g_fitnessCacheHits;
+	pthread_mutex_unlock(&g_fitnessCacheLock);
+}
+
+
+void GetBatchStats(uint64_t* genomes, uint64_t* batched, uint64_t* batches)
+{
+	pthread_mutex_lock(&g_batchLock);
+	*genomes = g_batchGenomes;
+	*batched = g_batchBatched;
+	*batches = g_batchBatches;
+	pthread_mutex_unlock(&g_batchLock);
+}
+
+
 Genome MateGenomes(Genome* const firstParent, Genome* const secondParent)
 {
 	Genome offspring;
@@ -235,6 +350,8 @@ void Genome::RandomizeID(void)
 
 uint16_t Genome::AddNode(NodeType type, uint16_t id)
 {
+	this->InvalidatePhenotype();
+
 	if(id==UINT16_MAX)
 	{
 		// Create the next free node
@@ -261,6 +378,7 @@ bool Genome::AddConnection(uint16_t from, uint16_t to, bool reenable, double inW
 	// 02 If it exists, is disabled, and reenable==true, enable the pair and return true. 
 	// 03 If it doesn't exist, create it and return true.
 	// 04 Else return false.
+	this->InvalidatePhenotype();
 
 	// See if the pair exists in the list of innovations.
 	map<pair<uint16_t,uint16_t>,uint16_t>::const_iterator 
@@ -307,108 +425,905 @@ bool Genome::AddConnection(uint16_t from, uint16_t to, bool reenable, double inW
 }
 
 
-double Genome::Activate(DataEntry data)
-{
-	// Put the DataEntry at the inputs
-	nodes[1].valueNow=data.node_id;
-	nodes[2].valueNow=data.relative_time;
-	nodes[3].valueNow=data.latitude;
-	nodes[4].valueNow=data.longitude;
-	nodes[5].valueNow=data.speed;
-	nodes[6].valueNow=data.heading;
-
-	// If the nodeID changed, reset the memory of the network.
-	if(nodes[1].valueNow != nodes[1].valueLast)
-		for(map<uint16_t, NodeGene>::iterator 
-			iterNode = nodes.begin();
-			iterNode != nodes.end();
-			iterNode++)
-			if(iterNode->second.type==NodeType::HIDDEN or iterNode->second.type==NodeType::OUTPUT)
-				iterNode->second.valueNow = 0.0;
-		
-	// Move all valueNow to valueLast, reset valueNow
-	for(map<uint16_t, NodeGene>::iterator 
-		iterNode = nodes.begin();
-		iterNode != nodes.end();
+void Phenotype::Compile(const Genome& genome)
+{
+	// Sensors take the first indices, so the features can be copied straight in.
+	map<uint16_t, uint16_t> index;
+	for(uint16_t n = 1; n <= g_inputs; n++)
+		index[n] = n-1;
+
+	// Nodes that cannot reach the output, and connections into them, never change a prediction.
+	set<uint16_t> live = genome.LiveNodes();
+
+	hidden.clear();
+	for(map<uint16_t, NodeGene>::const_iterator 
+		iterNode = genome.nodes.begin();
+		iterNode != genome.nodes.end();
 		iterNode++)
 	{
-		iterNode->second.valueLast = iterNode->second.valueNow;
-		iterNode->second.valueNow = 0.0;
+		if( (iterNode->second.type == NodeType::HIDDEN) and !live.count(iterNode->first) )
+			continue;
+		if(!index.count(iterNode->first))
+			{ uint16_t next = index.size(); index[iterNode->first] = next; }
+		if(iterNode->second.type == NodeType::HIDDEN)
+			hidden.push_back(index[iterNode->first]);
 	}
-	nodes[d_biasnode].valueNow = 1.0; // Don't touch the bias
-	nodes[d_biasnode].valueLast = 1.0;
 
-	// Run through each connection
+	links.clear();
 	for(map<uint16_t, ConnectionGene>::const_iterator 
-		iterConn = connections.begin();
-		iterConn != connections.end();
+		iterConn = genome.connections.begin();
+		iterConn != genome.connections.end();
 		iterConn++)
+		if( iterConn->second.enabled and live.count(iterConn->second.to_node) )
+		{
+			Link link;
+			if(!index.count(iterConn->second.from_node))
+				{ uint16_t next = index.size(); index[iterConn->second.from_node] = next; }
+			if(!index.count(iterConn->second.to_node))
+				{ uint16_t next = index.size(); index[iterConn->second.to_node] = next; }
+			link.from = index[iterConn->second.from_node];
+			link.to = index[iterConn->second.to_node];
+			link.weight = iterConn->second.weight;
+			links.push_back(link);
+		}
+
+	output = index[d_outputnode];
+	bias = index[d_biasnode];
+	initial = hidden.empty();
+	for(vector<Link>::const_iterator 
+		iterLink = links.begin();
+		iterLink != links.end();
+		iterLink++)
+		if(iterLink->to != output)
+			initial = false;
+	valueLast.assign(index.size(), 0.0);
+	valueNow.assign(index.size(), 0.0);
+
+	// Hash all that Activate() runs on: the nodes, the sigmoid ones, and the links in order.
+	uint64_t nodeCount = index.size();
+	topology = NEATRSU_HASH_SEED;
+	HashBytes(&topology, &nodeCount, sizeof(nodeCount));
+	HashBytes(&topology, &output, sizeof(output));
+	HashBytes(&topology, &bias, sizeof(bias));
+	HashBytes(&topology, hidden.data(), hidden.size()*sizeof(uint16_t));
+	hash = topology;
+	for(vector<Link>::const_iterator 
+		iterLink = links.begin();
+		iterLink != links.end();
+		iterLink++)
 	{
-		// Add the connection's effect to the destination node's 'valueNow'
-		if(iterConn->second.enabled)
-			nodes[iterConn->second.to_node].valueNow += 
-				nodes[iterConn->second.from_node].valueLast * iterConn->second.weight;
+		HashBytes(&topology, &iterLink->from, sizeof(iterLink->from));
+		HashBytes(&topology, &iterLink->to, sizeof(iterLink->to));
+		HashBytes(&hash, &iterLink->from, sizeof(iterLink->from));
+		HashBytes(&hash, &iterLink->to, sizeof(iterLink->to));
+		HashBytes(&hash, &iterLink->weight, sizeof(iterLink->weight));
 	}
 
-	// On hidden nodes, this value must now go through the activation sigmoid
-	// Check if there are hidden nodes
-	if(nodes.size() >= d_firsthidnode)
+	Lower();
+	compiledGeneration = g_generationNumber;
+	nativeTried = false;
+	native = 0;
+	compiled = true;
+}
+
+
+void Phenotype::Lower(void)
+{
+	// Each node's incoming connections, in order. Sensors and bias are set, never summed.
+	size_t nodeCount = valueNow.size();
+	vector< vector<const Link*> > incoming(nodeCount);
+	for(vector<Link>::const_iterator 
+		iterLink = links.begin();
+		iterLink != links.end();
+		iterLink++)
+		if( (iterLink->to >= g_inputs) and (iterLink->to != bias) )
+			incoming[iterLink->to].push_back(&*iterLink);
+
+	vector<bool> isHidden(nodeCount, false);
+	for(vector<uint16_t>::const_iterator 
+		iterHidden = hidden.begin();
+		iterHidden != hidden.end();
+		iterHidden++)
+		isHidden[*iterHidden] = true;
+
+	code.clear(); sources.clear(); weights.clear();
+	Instruction inputs = { OP_INPUTS, bias, 0, 0, 0 };
+	code.push_back(inputs);
+
+	// Every other node gets its sum (zero, if nothing leads to it), the output node last.
+	for(size_t k = g_inputs; k <= nodeCount; k++)
 	{
-		map<uint16_t, NodeGene>::iterator iterNode = nodes.begin();
-		for( advance(iterNode, d_firsthidnode-1-1);	
-		iterNode != nodes.end();
-		iterNode++)
-			if(iterNode->second.type==NodeType::HIDDEN)
-				iterNode->second.valueNow = ActivationSigmoid(iterNode->second.valueNow);
+		uint16_t n = (k == nodeCount) ? output : k;
+		if( (n == bias) or ((n == output) and (k != nodeCount)) ) continue;
+
+		Instruction instruction = { OP_ACCUMULATE, n, (uint16_t)incoming[n].size(), 0, (uint32_t)weights.size() };
+		bool run = (incoming[n].size() > 1);
+		for(size_t c = 0; c < incoming[n].size(); c++)
+		{
+			sources.push_back(incoming[n][c]->from);
+			weights.push_back(incoming[n][c]->weight);
+			run = run and (incoming[n][c]->from == incoming[n][0]->from + c);
+		}
+		if(run) { instruction.op = OP_RUN; instruction.first = incoming[n][0]->from; }
+		if(isHidden[n]) instruction.op = (instruction.op == OP_RUN) ? OP_RUN_SIGMOID : OP_ACCUMULATE_SIGMOID;
+		code.push_back(instruction);
 	}
 
+	Instruction last = { OP_OUTPUT, output, 0, 0, 0 };
+	code.push_back(last);
+	codeLast.assign(nodeCount, 0.0);
+	codeNow.assign(nodeCount, 0.0);
+}
+
+
+void Phenotype::Reset(void)
+{
+	fill(valueLast.begin(), valueLast.end(), 0.0);
+	fill(valueNow.begin(), valueNow.end(), 0.0);
+	fill(codeLast.begin(), codeLast.end(), 0.0);
+	fill(codeNow.begin(), codeNow.end(), 0.0);
+	fill(nativeLast.begin(), nativeLast.end(), 0.0);
+	fill(nativeNow.begin(), nativeNow.end(), 0.0);
+}
+
+
+double Phenotype::RunNative(const float* features)
+{
+	nativeLast.swap(nativeNow);
+	return native(features, nativeLast.data(), nativeNow.data(), ActivationSigmoid, ActivationOutput);
+}
+
+
+double Phenotype::Activate(const float* features)
+{
+	// This step's values become the last ones, with the entry's features at the inputs.
+	valueLast.swap(valueNow);
+	double* last = valueLast.data();
+	double* now = valueNow.data();
+	for(uint16_t n = 0; n < g_inputs; n++)
+		last[n] = features[n];
+	fill(valueNow.begin(), valueNow.end(), 0.0);
+	last[bias] = 1.0; // Don't touch the bias
+	now[bias] = 1.0;
+
+	// Run through each connection, adding its effect to the destination node
+	for(vector<Link>::const_iterator 
+		iterLink = links.begin();
+		iterLink != links.end();
+		iterLink++)
+		now[iterLink->to] += last[iterLink->from] * iterLink->weight;
+
+	// On hidden nodes, this value must now go through the activation sigmoid
+	for(vector<uint16_t>::const_iterator 
+		iterHidden = hidden.begin();
+		iterHidden != hidden.end();
+		iterHidden++)
+		now[*iterHidden] = ActivationSigmoid(now[*iterHidden]);
+
 	// Same for the output node
-	nodes[d_outputnode].valueNow = ActivationOutput(nodes[d_outputnode].valueNow);
+	now[output] = ActivationOutput(now[output]);
+	return now[output];
+}
+
+
+// Computed gotos (a GNU extension) dispatch each instruction straight to the next one's handler.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+double Phenotype::Interpret(const float* features)
+{
+	static const void* const dispatch[] = 
+		{ &&inputs, &&accumulate, &&accumulateSigmoid, &&run, &&runSigmoid, &&output };
+
+	codeLast.swap(codeNow);
+	double* last = codeLast.data();
+	double* now = codeNow.data();
+	const Instruction* ip = code.data();
+	const uint16_t* source;
+	const double* weight;
+	double sum;
+	goto *dispatch[ip->op];
+
+inputs:
+	for(uint16_t n = 0; n < g_inputs; n++)
+		last[n] = features[n];
+	last[ip->node] = 1.0;
+	now[ip->node] = 1.0;
+	goto *dispatch[(++ip)->op];
+
+accumulate:
+	sum = 0.0; source = &sources[ip->operand]; weight = &weights[ip->operand];
+	for(uint16_t c = 0; c < ip->count; c++)
+		sum += last[source[c]] * weight[c];
+	now[ip->node] = sum;
+	goto *dispatch[(++ip)->op];
+
+accumulateSigmoid:
+	sum = 0.0; source = &sources[ip->operand]; weight = &weights[ip->operand];
+	for(uint16_t c = 0; c < ip->count; c++)
+		sum += last[source[c]] * weight[c];
+	now[ip->node] = ActivationSigmoid(sum);
+	goto *dispatch[(++ip)->op];
+
+run:
+	sum = 0.0; weight = &weights[ip->operand];
+	for(uint16_t c = 0; c < ip->count; c++)
+		sum += last[ip->first + c] * weight[c];
+	now[ip->node] = sum;
+	goto *dispatch[(++ip)->op];
+
+runSigmoid:
+	sum = 0.0; weight = &weights[ip->operand];
+	for(uint16_t c = 0; c < ip->count; c++)
+		sum += last[ip->first + c] * weight[c];
+	now[ip->node] = ActivationSigmoid(sum);
+	goto *dispatch[(++ip)->op];
+
+output:
+	now[ip->node] = ActivationOutput(now[ip->node]);
+	return now[ip->node];
+}
+#pragma GCC diagnostic pop
+
+
+void Genome::CompileNative(void)
+{
+	if(!phenotype.compiled) phenotype.Compile(*this);
+	phenotype.nativeTried = true;
+	phenotype.native = LoadNativeActivation(phenotype);
+	phenotype.nativeLast.assign(phenotype.valueNow.size(), 0.0);
+	phenotype.nativeNow.assign(phenotype.valueNow.size(), 0.0);
+}
+
+
+double Genome::Activate(const float* features)
+{
+	if(!phenotype.compiled) phenotype.Compile(*this);
 
-	// Return the value at the output node
-	return nodes[d_outputnode].valueNow;
+	switch(gm_evaluator)
+	{
+		case Evaluator::BYTECODE:	return phenotype.native ? phenotype.RunNative(features) : phenotype.Interpret(features);
+		case Evaluator::VERIFY:
+		{
+			double activated = phenotype.Activate(features);
+			double interpreted = phenotype.Interpret(features);
+			if(memcmp(&activated, &interpreted, sizeof(double)) != 0)
+			{
+				cout << "\nERROR\tGenome " << hex << id << dec << " activates to " << setprecision(17) << activated 
+					 << ", but its bytecode to " << interpreted << "." << endl;
+				exit(1);
+			}
+			double run = phenotype.native ? phenotype.RunNative(features) : activated;
+			if(memcmp(&activated, &run, sizeof(double)) != 0)
+			{
+				cout << "\nERROR\tGenome " << hex << id << dec << " activates to " << setprecision(17) << activated 
+					 << ", but its native code to " << run << "." << endl;
+				exit(1);
+			}
+			return activated;
+		}
+		default:					return phenotype.native ? phenotype.RunNative(features) : phenotype.Activate(features);
+	}
 }
 
 
-double Genome::GetFitness(vector<DataEntry>* database, bool store)
+double Genome::GetFitness(const Dataset* database, double* predictions)
 {
 	double rfitness = 0.0;
+	this->AccumulateError(database, &rfitness, predictions);
+	return FitnessFromError(rfitness);
+}
+
+
+double Genome::GetFitness(DatabaseStream* stream)
+{
+	double rfitness = 0.0;
+	Dataset block;
+
+	stream->Rewind();
+	while(stream->NextBlock(&block))
+		this->AccumulateError(&block, &rfitness);
+
+	return FitnessFromError(rfitness);
+}
 
-	// Reset genome.
-	this->ResetNodes();
 
-	/* Go through every entry. Perform an activation, get the prediction.
-	 * Sum the square of errors.
+void Genome::AccumulateError(const Dataset* database, double* sse, double* predictions)
+{
+	/* Go through every vehicle, in order.
 	 * IMPORTANT: the entry database must be sorted logically for recurrent networks to make sense 
 	 */
-	for(vector<DataEntry>::iterator 
-		iterDB = database->begin();
-		iterDB != database->end();
-		iterDB++)
+	if( (gm_genomeThreads > 1) and (database->segments.size() > 1) )
+		this->AccumulateErrorThreads(database, sse, predictions);
+	else
+		this->AccumulateError(database, database->segments.data(), database->segments.size(), sse, predictions);
+}
+
+
+// For carrying a share of a genome's evaluation to its thread.
+struct threadDataAccumulateError
+{
+	const Genome* genome;
+	const Dataset* database;
+	const DatasetSegment* segments;
+	size_t count;
+	double* predictions;
+	double* rowErrors;
+};
+
+
+static void* ThreadAccumulateSegments(void* threadarg)
+{
+	threadDataAccumulateError* share = (threadDataAccumulateError*)threadarg;
+
+	// A copy of its own, for the recurrent state. (A blank genome would draw a random ID.)
+	Genome genome = *share->genome;
+	double sse = 0;
+	genome.AccumulateError(share->database, share->segments, share->count, &sse, share->predictions, share->rowErrors);
+	pthread_exit(NULL);
+}
+
+
+void Genome::AccumulateErrorThreads(const Dataset* database, double* sse, double* predictions)
+{
+	/* Split the vehicles into gm_genomeThreads runs of about as many entries, each on its own
+	 * copy of the genome (and so its own recurrent state). Threads store each entry's error at
+	 * its row, and they are summed here in entry order: the sum is the same for any thread count.
+	 */
+	if(!phenotype.compiled) phenotype.Compile(*this);
+	vector<double> rowErrors(database->size);
+	vector<threadDataAccumulateError> shares(min((size_t)gm_genomeThreads, database->segments.size()));
+	vector<pthread_t> threads(shares.size());
+
+	size_t next = 0;
+	uint64_t assigned = 0;
+	for(size_t t = 0; t < shares.size(); t++)
 	{
-		double prediction = this->Activate(*iterDB);
-		rfitness += pow(prediction - iterDB->contact_time, 2);
-		if(store) iterDB->prediction=prediction;
+		shares[t].genome = this;
+		shares[t].database = database;
+		shares[t].segments = &database->segments[next];
+		shares[t].predictions = predictions;
+		shares[t].rowErrors = rowErrors.data();
+
+		// Take vehicles up to this thread's part of the entries, leaving one for every later thread.
+		uint64_t target = database->size * (t+1) / shares.size();
+		size_t end = next;
+		do
+			{ assigned += database->segments[end].end - database->segments[end].begin; end++; }
+		while( (assigned < target) and (database->segments.size() - end > shares.size() - t - 1) );
+		if(t == shares.size()-1) 
+			end = database->segments.size();
+		shares[t].count = end - next;
+		next = end;
+
+		int rc = pthread_create(&threads[t], NULL, ThreadAccumulateSegments, (void *)&shares[t]);
+		assert(rc == 0);
 	}
 
-	if( boost::math::isinf(rfitness) )
-		return 0;
-	return 1.0/(rfitness+1.0);
+	for(size_t t = 0; t < threads.size(); t++)
+		pthread_join(threads[t], NULL);
+
+	for(vector<DatasetSegment>::const_iterator 
+		iterSegment = database->segments.begin();
+		iterSegment != database->segments.end();
+		iterSegment++)
+		for(uint64_t i = iterSegment->begin; i < iterSegment->end; i++)
+			*sse += rowErrors[i];
+}
+
+
+void Genome::AccumulateError(const Dataset* database, const DatasetSample* sample, double* sse)
+{
+	this->AccumulateError(database, sample->segments.data(), sample->segments.size(), sse);
+}
+
+
+void Genome::AccumulateError(const Dataset* database, const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+{
+	// A genome that has gone unchanged long enough moves on to native code.
+	if(!phenotype.compiled) phenotype.Compile(*this);
+	if( gm_nativeAfter and !phenotype.nativeTried and (g_generationNumber - phenotype.compiledGeneration >= gm_nativeAfter) )
+		this->CompileNative();
+
+	if( (gm_precision == Precision::FLOAT) or ((gm_lanes > 1) and !phenotype.native) )
+		{ this->AccumulateErrorLanes(database, segments, count, sse, predictions, rowErrors); return; }
+
+	for(size_t s = 0; s < count; s++)
+		this->AccumulateError(database, segments[s], sse, predictions, rowErrors);
+}
+
+
+void Genome::AccumulateError(const Dataset* database, const DatasetSegment& segment, double* sse, double* predictions, double* rowErrors)
+{
+	// Each vehicle starts with a clean memory.
+	this->ResetNodes();
+
+	/* Perform an activation on every entry, get the prediction, and sum the square of errors.
+	 * A compacted entry counts as the samples it stands for, against each of their targets.
+	 */
+	if(database->isEncoded)
+	{
+		// Decode each row as we go.
+		SegmentDecoder decoder(database, segment);
+		float features[DATASET_MAX_FEATURES];
+		for(uint64_t i = segment.begin; i < segment.end; i++)
+		{
+			decoder.Next(features);
+			double prediction = this->Activate(features);
+			double error = (double)decoder.Weight() * pow(prediction - decoder.TargetMean(), 2) + decoder.TargetSpread();
+			*sse += error;
+			if(rowErrors) rowErrors[i]=error;
+			if(predictions) predictions[i]=prediction;
+		}
+	}
+	else
+		for(uint64_t i = segment.begin; i < segment.end; i++)
+		{
+			double prediction = this->Activate(&database->features[i*database->featureCount]);
+			double weight = database->weights ? database->weights[i] : 1;
+			double target = database->targetMeans ? database->targetMeans[i] : database->contact_time[i];
+			double spread = database->targetSpreads ? database->targetSpreads[i] : 0;
+			double error = weight * pow(prediction - target, 2) + spread;
+			*sse += error;
+			if(rowErrors) rowErrors[i]=error;
+			if(predictions) predictions[i]=prediction;
+		}
+}
+
+
+/* Lane evaluation: each of LANES lanes runs its own vehicle through the phenotype, all in lockstep.
+ * Every node holds a vector of LANES values, so every connection is one multiply and one add.
+ * A lane whose vehicle ends is refilled with the next one; with none left, it idles until the window ends.
+ * Values are doubles, or floats in single precision, where hidden nodes use the approximate sigmoid.
+ */
+typedef double LaneValues2 __attribute__((vector_size(2*sizeof(double))));
+typedef double LaneValues4 __attribute__((vector_size(4*sizeof(double))));
+typedef double LaneValues8 __attribute__((vector_size(8*sizeof(double))));
+typedef float LaneFloats2 __attribute__((vector_size(2*sizeof(float))));
+typedef float LaneFloats4 __attribute__((vector_size(4*sizeof(float))));
+typedef float LaneFloats8 __attribute__((vector_size(8*sizeof(float))));
+typedef float LaneFloats16 __attribute__((vector_size(16*sizeof(float))));
+
+// Working memory of the lane kernels. Each thread keeps its own, grown to the largest network it ran.
+struct LaneScratch
+{
+	void* block;
+	size_t bytes;
+	vector<double> errors;
+
+	LaneScratch() : block(0), bytes(0) {}
+	~LaneScratch() { free(block); }
+
+	// At least 'size' bytes, aligned for any lane vector.
+	void* Reserve(size_t size)
+	{
+		if(size <= bytes) return block;
+		free(block);
+		bytes = (size + 63) & ~size_t(63);
+		block = aligned_alloc(64, bytes);
+		if(!block) { cout << "\nERROR\tOut of memory." << endl; exit(1); }
+		return block;
+	}
+};
+static thread_local LaneScratch g_laneScratch;	// Per thread scratch of AccumulateLanes
+static thread_local LaneScratch g_batchScratch;	// Per thread scratch of AccumulateBatch
+
+/* Given INITIAL, the kernel is specialized to the shape of the initial network (see Phenotype::initial),
+ * with at most GENOME_INITIAL_LINKS links. Only the output takes a value: it is summed in a register, in
+ * link order, so no other node is cleared or written at each step.
+ */
+template<typename Scalar, typename Values, int LANES, bool INITIAL = false>
+static inline __attribute__((always_inline)) void AccumulateLanes(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+{
+	size_t nodeCount = phenotype.valueNow.size();
+	size_t linkCount = phenotype.links.size();
+	uint16_t initialFrom[GENOME_INITIAL_LINKS];
+	Scalar initialWeight[GENOME_INITIAL_LINKS];
+	if(INITIAL)
+		for(size_t k = 0; k < linkCount; k++)
+		{
+			initialFrom[k] = phenotype.links[k].from;
+			initialWeight[k] = phenotype.links[k].weight;
+		}
+
+	// Node values first, then the link weights, in this thread's scratch.
+	Values* last = (Values*)g_laneScratch.Reserve(2*nodeCount*sizeof(Values) + linkCount*sizeof(Scalar));
+	Values* now = last + nodeCount;
+	Scalar* linkWeights = (Scalar*)(now + nodeCount);
+	for(size_t k = 0; k < linkCount; k++)
+		linkWeights[k] = phenotype.links[k].weight;
+	const Values zero = {};
+
+	vector<double>& errors = g_laneScratch.errors;
+	float features[DATASET_MAX_FEATURES];
+
+	const DatasetSegment* laneSegment[LANES];
+	uint64_t laneRow[LANES];
+	uint64_t laneError[LANES];
+	SegmentDecoder laneDecoder[LANES];
+
+	size_t next = 0;
+	while(next < count)
+	{
+		// Take a window of whole segments. The error of each of their entries is kept at its place in the window.
+		size_t windowEnd = next;
+		uint64_t windowEntries = 0;
+		do
+		{
+			windowEntries += segments[windowEnd].end - segments[windowEnd].begin;
+			windowEnd++;
+		} while( (windowEnd < count) 
+				and (windowEntries + segments[windowEnd].end - segments[windowEnd].begin <= GENOME_LANE_WINDOW) );
+		if(errors.size() < windowEntries) errors.resize(windowEntries);
+
+		// Start a vehicle on every lane, from a clean state.
+		uint64_t assignedEntries = 0;
+		uint16_t activeLanes = 0;
+		for(size_t n = 0; n < nodeCount; n++)
+			{ last[n] = zero; now[n] = zero; }
+		for(uint16_t l = 0; l < LANES; l++)
+		{
+			laneSegment[l] = 0;
+			if(next < windowEnd)
+			{
+				laneSegment[l] = &segments[next++];
+				laneRow[l] = laneSegment[l]->begin;
+				laneError[l] = assignedEntries;
+				assignedEntries += laneSegment[l]->end - laneSegment[l]->begin;
+				if(database->isEncoded) laneDecoder[l] = SegmentDecoder(database, *laneSegment[l]);
+				activeLanes++;
+			}
+		}
+
+		while(activeLanes > 0)
+		{
+			// This step's values become the last ones, with each lane's features at the inputs.
+			swap(last, now);
+			double target[LANES];
+			double weight[LANES];
+			double spread[LANES];
+			for(uint16_t l = 0; l < LANES; l++)
+			{
+				const float* row = features;
+				if(!laneSegment[l])
+					{ for(uint16_t n = 0; n < g_inputs; n++) features[n] = 0; }
+				else if(database->isEncoded)
+				{
+					laneDecoder[l].Next(features);
+					target[l] = laneDecoder[l].TargetMean();
+					weight[l] = laneDecoder[l].Weight();
+					spread[l] = laneDecoder[l].TargetSpread();
+				}
+				else
+				{
+					row = &database->features[laneRow[l]*database->featureCount];
+					target[l] = database->targetMeans ? database->targetMeans[laneRow[l]] : database->contact_time[laneRow[l]];
+					weight[l] = database->weights ? database->weights[laneRow[l]] : 1;
+					spread[l] = database->targetSpreads ? database->targetSpreads[laneRow[l]] : 0;
+				}
+				for(uint16_t n = 0; n < g_inputs; n++)
+					last[n][l] = row[n];
+			}
+			last[phenotype.bias] = zero + 1.0;
+			if(INITIAL)
+			{
+				Values sum = zero;
+				for(size_t k = 0; k < linkCount; k++)
+					sum += last[initialFrom[k]] * initialWeight[k];
+				now[phenotype.output] = sum;
+			}
+			else
+			{
+				for(size_t n = 0; n < nodeCount; n++)
+					now[n] = zero;
+				now[phenotype.bias] = zero + 1.0;
+
+				// Run through each connection, on every lane
+				const Scalar* linkWeight = linkWeights;
+				for(vector<Phenotype::Link>::const_iterator 
+					iterLink = phenotype.links.begin();
+					iterLink != phenotype.links.end();
+					iterLink++)
+					now[iterLink->to] += last[iterLink->from] * *linkWeight++;
+			}
+
+			for(vector<uint16_t>::const_iterator 
+				iterHidden = phenotype.hidden.begin();
+				iterHidden != phenotype.hidden.end();
+				iterHidden++)
+				if(sizeof(Scalar) == sizeof(float))
+				{
+					Values value = 2.45f*now[*iterHidden];
+					FastTanh(&value);
+					now[*iterHidden] = 0.5f + 0.5f*value;
+				}
+				else
+					for(uint16_t l = 0; l < LANES; l++)
+						now[*iterHidden][l] = ActivationSigmoid(now[*iterHidden][l]);
+
+			// Note each lane's error, and move on to the next entry (or vehicle).
+			for(uint16_t l = 0; l < LANES; l++)
+			{
+				if(!laneSegment[l]) continue;
+
+				double prediction = ActivationOutput(now[phenotype.output][l]);
+				now[phenotype.output][l] = prediction;
+				errors[laneError[l]] = weight[l] * pow(prediction - target[l], 2) + spread[l];
+				if(rowErrors) rowErrors[laneRow[l]] = errors[laneError[l]];
+				laneError[l]++;
+				if(predictions) predictions[laneRow[l]] = prediction;
+
+				if(++laneRow[l] == laneSegment[l]->end)
+				{
+					laneSegment[l] = 0;
+					activeLanes--;
+					if(next < windowEnd)
+					{
+						laneSegment[l] = &segments[next++];
+						laneRow[l] = laneSegment[l]->begin;
+						laneError[l] = assignedEntries;
+						assignedEntries += laneSegment[l]->end - laneSegment[l]->begin;
+						if(database->isEncoded) laneDecoder[l] = SegmentDecoder(database, *laneSegment[l]);
+						activeLanes++;
+					}
+					for(size_t n = 0; n < nodeCount; n++)
+						{ last[n][l] = 0.0; now[n][l] = 0.0; }
+				}
+			}
+		}
+
+		// Sum the window's errors in entry order.
+		for(uint64_t e = 0; e < windowEntries; e++)
+			*sse += errors[e];
+	}
+}
+
+
+// Runs an initial-shaped network on its specialized kernel, and any other on the generic one.
+template<typename Scalar, typename Values, int LANES>
+static inline __attribute__((always_inline)) void DispatchLanes(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+{
+	if( phenotype.initial and (phenotype.links.size() <= GENOME_INITIAL_LINKS) )
+		AccumulateLanes<Scalar, Values, LANES, true>(phenotype, database, segments, count, sse, predictions, rowErrors);
+	else
+		AccumulateLanes<Scalar, Values, LANES>(phenotype, database, segments, count, sse, predictions, rowErrors);
+}
+
+
+// One build of the lane evaluation per instruction set, picked at run time.
+__attribute__((target("avx512f")))
+static void AccumulateLanesAVX512(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+	{ DispatchLanes<double, LaneValues8, 8>(phenotype, database, segments, count, sse, predictions, rowErrors); }
+
+__attribute__((target("avx512f")))
+static void AccumulateFloatLanesAVX512(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+	{ DispatchLanes<float, LaneFloats16, 16>(phenotype, database, segments, count, sse, predictions, rowErrors); }
+
+__attribute__((target("avx2")))
+static void AccumulateLanesAVX2(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+	{ DispatchLanes<double, LaneValues4, 4>(phenotype, database, segments, count, sse, predictions, rowErrors); }
+
+__attribute__((target("avx2")))
+static void AccumulateFloatLanesAVX2(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+	{ DispatchLanes<float, LaneFloats8, 8>(phenotype, database, segments, count, sse, predictions, rowErrors); }
+
+static void AccumulateLanesSSE2(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+	{ DispatchLanes<double, LaneValues2, 2>(phenotype, database, segments, count, sse, predictions, rowErrors); }
+
+static void AccumulateFloatLanesSSE2(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+	{ DispatchLanes<float, LaneFloats4, 4>(phenotype, database, segments, count, sse, predictions, rowErrors); }
+
+static void AccumulateFloatLanesPair(const Phenotype& phenotype, const Dataset* database, 
+	const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+	{ DispatchLanes<float, LaneFloats2, 2>(phenotype, database, segments, count, sse, predictions, rowErrors); }
+
+
+uint16_t SupportedLanes(void)
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))	return 8;
+	if(__builtin_cpu_supports("avx2"))		return 4;
+	return 2;
+}
+
+
+void Genome::AccumulateErrorLanes(const Dataset* database, const DatasetSegment* segments, size_t count, double* sse, double* predictions, double* rowErrors)
+{
+	if(!phenotype.compiled) phenotype.Compile(*this);
+
+	if(gm_precision == Precision::FLOAT)
+		switch(gm_lanes)
+		{
+			case 8:		AccumulateFloatLanesAVX512(phenotype, database, segments, count, sse, predictions, rowErrors); return;
+			case 4:		AccumulateFloatLanesAVX2(phenotype, database, segments, count, sse, predictions, rowErrors); return;
+			case 2:		AccumulateFloatLanesSSE2(phenotype, database, segments, count, sse, predictions, rowErrors); return;
+			default:	AccumulateFloatLanesPair(phenotype, database, segments, count, sse, predictions, rowErrors); return;
+		}
+
+	switch(gm_lanes)
+	{
+		case 8:		AccumulateLanesAVX512(phenotype, database, segments, count, sse, predictions, rowErrors); break;
+		case 4:		AccumulateLanesAVX2(phenotype, database, segments, count, sse, predictions, rowErrors); break;
+		default:	AccumulateLanesSSE2(phenotype, database, segments, count, sse, predictions, rowErrors); break;
+	}
+}
+
+
+/* Batch evaluation: up to LANES genomes with the same topology run as one network, whose weights
+ * are vectors with a lane per genome. Every lane runs the same vehicle, so each entry is read and
+ * decoded once for the whole batch, and each genome adds its own errors to its 'sse' in order.
+ */
+template<typename Scalar, typename Values, int LANES>
+static inline __attribute__((always_inline)) void AccumulateBatch(Genome* const* batch, uint16_t batchSize, 
+	const Dataset* database, const DatasetSegment* segments, size_t count)
+{
+	const Phenotype& shape = batch[0]->phenotype;
+	size_t nodeCount = shape.valueNow.size();
+	size_t linkCount = shape.links.size();
+	Values* last = (Values*)g_batchScratch.Reserve((2*nodeCount + linkCount)*sizeof(Values));
+	Values* now = last + nodeCount;
+	Values* linkWeights = now + nodeCount;
+	const Values zero = {};
+
+	// Unused lanes run with no weights, and are ignored.
+	for(size_t k = 0; k < linkCount; k++)
+	{
+		linkWeights[k] = zero;
+		for(uint16_t l = 0; l < batchSize; l++)
+			linkWeights[k][l] = batch[l]->phenotype.links[k].weight;
+	}
+
+	float features[DATASET_MAX_FEATURES];
+	for(size_t s = 0; s < count; s++)
+	{
+		// Each vehicle starts with a clean memory.
+		for(size_t n = 0; n < nodeCount; n++)
+			{ last[n] = zero; now[n] = zero; }
+		SegmentDecoder decoder;
+		if(database->isEncoded) decoder = SegmentDecoder(database, segments[s]);
+
+		for(uint64_t i = segments[s].begin; i < segments[s].end; i++)
+		{
+			const float* row = features;
+			double target, weight, spread;
+			if(database->isEncoded)
+			{
+				decoder.Next(features);
+				target = decoder.TargetMean();
+				weight = decoder.Weight();
+				spread = decoder.TargetSpread();
+			}
+			else
+			{
+				row = &database->features[i*database->featureCount];
+				target = database->targetMeans ? database->targetMeans[i] : database->contact_time[i];
+				weight = database->weights ? database->weights[i] : 1;
+				spread = database->targetSpreads ? database->targetSpreads[i] : 0;
+			}
+
+			// This step's values become the last ones, with the entry's features on every lane.
+			swap(last, now);
+			for(uint16_t n = 0; n < g_inputs; n++)
+				last[n] = zero + row[n];
+			for(size_t n = 0; n < nodeCount; n++)
+				now[n] = zero;
+			last[shape.bias] = zero + 1.0;
+			now[shape.bias] = zero + 1.0;
+
+			// Run through each connection, with every genome's weight
+			const Values* linkWeight = linkWeights;
+			for(vector<Phenotype::Link>::const_iterator 
+				iterLink = shape.links.begin();
+				iterLink != shape.links.end();
+				iterLink++)
+				now[iterLink->to] += last[iterLink->from] * *linkWeight++;
+
+			for(vector<uint16_t>::const_iterator 
+				iterHidden = shape.hidden.begin();
+				iterHidden != shape.hidden.end();
+				iterHidden++)
+				if(sizeof(Scalar) == sizeof(float))
+				{
+					Values value = 2.45f*now[*iterHidden];
+					FastTanh(&value);
+					now[*iterHidden] = 0.5f + 0.5f*value;
+				}
+				else
+					for(uint16_t l = 0; l < batchSize; l++)
+						now[*iterHidden][l] = ActivationSigmoid(now[*iterHidden][l]);
+
+			for(uint16_t l = 0; l < batchSize; l++)
+			{
+				double prediction = ActivationOutput(now[shape.output][l]);
+				now[shape.output][l] = prediction;
+				batch[l]->sse += weight * pow(prediction - target, 2) + spread;
+			}
+		}
+	}
+}
+
+
+// One build of the batch evaluation per instruction set, as with lanes.
+__attribute__((target("avx512f")))
+static void AccumulateBatchAVX512(Genome* const* batch, uint16_t batchSize, const Dataset* database, const DatasetSegment* segments, size_t count)
+	{ AccumulateBatch<double, LaneValues8, 8>(batch, batchSize, database, segments, count); }
+
+__attribute__((target("avx512f")))
+static void AccumulateFloatBatchAVX512(Genome* const* batch, uint16_t batchSize, const Dataset* database, const DatasetSegment* segments, size_t count)
+	{ AccumulateBatch<float, LaneFloats16, 16>(batch, batchSize, database, segments, count); }
+
+__attribute__((target("avx2")))
+static void AccumulateBatchAVX2(Genome* const* batch, uint16_t batchSize, const Dataset* database, const DatasetSegment* segments, size_t count)
+	{ AccumulateBatch<double, LaneValues4, 4>(batch, batchSize, database, segments, count); }
+
+__attribute__((target("avx2")))
+static void AccumulateFloatBatchAVX2(Genome* const* batch, uint16_t batchSize, const Dataset* database, const DatasetSegment* segments, size_t count)
+	{ AccumulateBatch<float, LaneFloats8, 8>(batch, batchSize, database, segments, count); }
+
+static void AccumulateBatchSSE2(Genome* const* batch, uint16_t batchSize, const Dataset* database, const DatasetSegment* segments, size_t count)
+	{ AccumulateBatch<double, LaneValues2, 2>(batch, batchSize, database, segments, count); }
+
+static void AccumulateFloatBatchSSE2(Genome* const* batch, uint16_t batchSize, const Dataset* database, const DatasetSegment* segments, size_t count)
+	{ AccumulateBatch<float, LaneFloats4, 4>(batch, batchSize, database, segments, count); }
+
+
+// How many genomes a batch holds: a genome per lane, twice as many lanes in single precision.
+static uint16_t BatchLanes(void)
+{
+	return (gm_precision == Precision::FLOAT) ? 2*gm_lanes : gm_lanes;
+}
+
+
+// Run a batch of genomes of the same topology, at most BatchLanes() of them.
+static void AccumulateBatchError(Genome* const* batch, uint16_t batchSize, const Dataset* database, const DatasetSegment* segments, size_t count)
+{
+	if(gm_precision == Precision::FLOAT)
+		switch(gm_lanes)
+		{
+			case 8:		AccumulateFloatBatchAVX512(batch, batchSize, database, segments, count); return;
+			case 4:		AccumulateFloatBatchAVX2(batch, batchSize, database, segments, count); return;
+			default:	AccumulateFloatBatchSSE2(batch, batchSize, database, segments, count); return;
+		}
+
+	switch(gm_lanes)
+	{
+		case 8:		AccumulateBatchAVX512(batch, batchSize, database, segments, count); break;
+		case 4:		AccumulateBatchAVX2(batch, batchSize, database, segments, count); break;
+		default:	AccumulateBatchSSE2(batch, batchSize, database, segments, count); break;
+	}
+}
+
+
+// True if two compiled phenotypes differ only in their weights.
+static bool SameTopology(const Phenotype& first, const Phenotype& second)
+{
+	if( (first.topology != second.topology) or (first.valueNow.size() != second.valueNow.size()) 
+		or (first.output != second.output) or (first.bias != second.bias) 
+		or (first.hidden != second.hidden) or (first.links.size() != second.links.size()) )
+		return false;
+	for(size_t k = 0; k < first.links.size(); k++)
+		if( (first.links[k].from != second.links[k].from) or (first.links[k].to != second.links[k].to) )
+			return false;
+	return true;
 }
 
 
 void Genome::WipeMemory(void)
 {
 	// Clean every node's memory.
-	for(map<uint16_t, NodeGene>::iterator 
-		iterNode = nodes.begin();
-		iterNode != nodes.end();
-		iterNode++)
-	{ iterNode->second.valueLast = 0; iterNode->second.valueNow = 0; }
+	if(!phenotype.compiled) phenotype.Compile(*this);
+	phenotype.Reset();
 
 	// Set bias node back to '1'
-	nodes[d_biasnode].valueNow = 1.0;
-	nodes[d_biasnode].valueLast = 1.0;
+	phenotype.valueNow[phenotype.bias] = 1.0;
+	phenotype.valueLast[phenotype.bias] = 1.0;
 }
 
 
@@ -417,6 +1332,8 @@ void Genome::WipeMemory(void)
 
 void Genome::MutatePerturbWeights(void)
 {
+	this->InvalidatePhenotype();
+
 	// Go through each connection, perturb its weight.
 		for(map<uint16_t, ConnectionGene>::iterator 
 		iterConn = connections.begin();
@@ -501,6 +1418,7 @@ void Genome::MutateAddNode(void)
 
 	// Disable it
 	iterConnection->second.enabled = false;
+	this->InvalidatePhenotype();
 
 	// Create a new node.
 	uint16_t newNodeId = this->AddNode(NodeType::HIDDEN);
@@ -530,6 +1448,7 @@ void Genome::MutateDisableConnection(void)
 
 	// Disable it.
 	iterConnection->second.enabled = false;
+	this->InvalidatePhenotype();
 }
 
 
@@ -546,6 +1465,7 @@ void Genome::MutateDisableNode(void)
 	advance(iterHidNode, randomNodeId);
 
 	// Disable all connections that involve this node.
+	this->InvalidatePhenotype();
 	for(map<uint16_t, ConnectionGene>::iterator 
 		iterConn = connections.begin();
 		iterConn != connections.end();
@@ -576,13 +1496,64 @@ pair<uint16_t,uint16_t> Genome::CountEnabledGenes(void)
 }
 
 
+set<uint16_t> Genome::LiveNodes(void) const
+{
+	// Walk the enabled connections backwards from the output.
+	map< uint16_t, vector<uint16_t> > incoming;
+	for(map<uint16_t, ConnectionGene>::const_iterator 
+		iterConn = connections.begin();
+		iterConn != connections.end();
+		iterConn++)
+		if(iterConn->second.enabled)
+			incoming[iterConn->second.to_node].push_back(iterConn->second.from_node);
+
+	set<uint16_t> live;
+	vector<uint16_t> pending(1, d_outputnode);
+	live.insert(d_outputnode);
+	while(!pending.empty())
+	{
+		uint16_t node = pending.back();
+		pending.pop_back();
+		for(vector<uint16_t>::const_iterator 
+			iterFrom = incoming[node].begin();
+			iterFrom != incoming[node].end();
+			iterFrom++)
+			if(live.insert(*iterFrom).second)
+				pending.push_back(*iterFrom);
+	}
+
+	return live;
+}
+
+
+Genome Genome::Pruned(void) const
+{
+	set<uint16_t> live = this->LiveNodes();
+	Genome pruned = *this;
+	pruned.InvalidatePhenotype();
+
+	map<uint16_t, NodeGene>::iterator iterNode = pruned.nodes.begin();
+	while(iterNode != pruned.nodes.end())
+		if( (iterNode->second.type == NodeType::HIDDEN) and !live.count(iterNode->first) )
+			iterNode = pruned.nodes.erase(iterNode);
+		else
+			iterNode++;
+
+	map<uint16_t, ConnectionGene>::iterator iterConn = pruned.connections.begin();
+	while(iterConn != pruned.connections.end())
+		if( !iterConn->second.enabled or !live.count(iterConn->second.to_node) )
+			iterConn = pruned.connections.erase(iterConn);
+		else
+			iterConn++;
+
+	return pruned;
+}
+
+
 void Genome::ResetNodes(void)
 {
-	for(map<uint16_t, NodeGene>::iterator 
-		iterNode = nodes.begin();
-		iterNode != nodes.end();
-		iterNode++)
-	{ iterNode->second.valueNow = 0.0; iterNode->second.valueLast = 0.0; }
+	if(!phenotype.compiled) phenotype.Compile(*this);
+	phenotype.Reset();
 }
 
 
@@ -900,13 +1871,167 @@ Genome* Species::FindChampion(void)
 
 
 
-void Species::UpdateGenomeFitness(vector<DataEntry>* database)
+void Species::UpdateGenomeFitness(const vector<Species*>& group, const Dataset* database, float survivalThreshold)
+{
+	for(vector<Species*>::const_iterator
+		iterSpecies = group.begin();
+		iterSpecies != group.end();
+		iterSpecies++)
+		(*iterSpecies)->PrepareGenomeFitness();
+
+	AccumulateGenomeError(group, database, 0, true);
+
+	for(vector<Species*>::const_iterator
+		iterSpecies = group.begin();
+		iterSpecies != group.end();
+		iterSpecies++)
+		(*iterSpecies)->FinishGenomeFitness(database, survivalThreshold);
+}
+
+
+void Species::PrepareGenomeFitness(void)
+{
+	// Networks already scored take their error from the fitness cache.
+	for(list<Genome>::iterator
+		iterGenome = genomes.begin();
+		iterGenome != genomes.end();
+		iterGenome++)
+	{
+		iterGenome->sse = 0;
+		iterGenome->culled = false;
+		iterGenome->cachedFitness = false;
+		if(gm_fitnessCache)
+		{
+			if(!iterGenome->phenotype.compiled) iterGenome->phenotype.Compile(*iterGenome);
+			iterGenome->cachedFitness = LookupFitnessCache(iterGenome->phenotype.hash, &iterGenome->sse);
+		}
+	}
+}
+
+
+void Species::FinishGenomeFitness(const Dataset* database, float survivalThreshold)
 {
+	// Culled genomes are worse than every other (but cached ones past the boundary), so they are the first 
+	// killed. If there are more of them than will be killed, some survive: finish those that can still score.
+	uint16_t culledCount = 0;
+	for(list<Genome>::iterator
+		iterGenome = genomes.begin();
+		iterGenome != genomes.end();
+		iterGenome++)
+		culledCount += iterGenome->culled or (iterGenome->sse > survivalError);
+
+	if(culledCount > (uint16_t)(genomes.size() * survivalThreshold))
+		for(list<Genome>::iterator
+			iterGenome = genomes.begin();
+			iterGenome != genomes.end();
+			iterGenome++)
+			if( iterGenome->culled and boost::math::isfinite(iterGenome->sse) )
+			{
+				// Culled after the last tile, there is nothing left to run.
+				if(iterGenome->culledAfter < database->segments.size())
+					iterGenome->AccumulateError(database, database->segments.data() + iterGenome->culledAfter, 
+						database->segments.size() - iterGenome->culledAfter, &iterGenome->sse);
+				iterGenome->culled = false;
+			}
+
 	for(list<Genome>::iterator
 		iterGenome = genomes.begin();
 		iterGenome != genomes.end();
 		iterGenome++)
-		iterGenome->fitness = iterGenome->GetFitness(database);
+	{
+		iterGenome->fitness = FitnessFromError(iterGenome->sse);
+		if( gm_fitnessCache and !iterGenome->culled and !iterGenome->cachedFitness )
+			StoreFitnessCache(iterGenome->phenotype.hash, iterGenome->sse);
+	}
+}
+
+
+// How many bytes of data a tile of Species::AccumulateGenomeError holds.
+static uint64_t TileBytes(void)
+{
+	static const uint64_t bytes = (sysconf(_SC_LEVEL2_CACHE_SIZE) > 0) ? sysconf(_SC_LEVEL2_CACHE_SIZE)/2 : GENOME_TILE_BYTES;
+	return bytes;
+}
+
+
+void Species::AccumulateGenomeError(const vector<Species*>& group, const Dataset* database, 
+	const DatasetSample* sample, bool cull)
+{
+	const vector<DatasetSegment>& segments = sample ? sample->segments : database->segments;
+
+	/* Go through the data a tile of whole vehicles at a time, small enough to stay in cache while
+	 * every genome of the group runs over it. A vehicle starts from a clean state, so no genome needs 
+	 * to carry its recurrent state across tiles, and each genome still adds its errors in entry order.
+	 */
+	size_t tileEnd;
+	for(size_t tile = 0; tile < segments.size(); tile = tileEnd)
+	{
+		uint64_t entryBytes = (database->featureCount+1)*sizeof(float);
+		uint64_t tileBytes = 0;
+		tileEnd = tile;
+		do
+		{
+			tileBytes += (segments[tileEnd].end - segments[tileEnd].begin) * entryBytes;
+			tileEnd++;
+		} while( (tileEnd < segments.size()) 
+				and (tileBytes + (segments[tileEnd].end - segments[tileEnd].begin) * entryBytes <= TileBytes()) );
+
+		// The genomes still to run on this tile, with the error past which each is culled. With 
+		// --batch-topologies, those that share a topology are grouped in batches, across species; 
+		// the others run on their own.
+		vector< vector<Genome*> > batches;
+		vector< vector<double> > cutoffs;
+		for(vector<Species*>::const_iterator
+			iterSpecies = group.begin();
+			iterSpecies != group.end();
+			iterSpecies++)
+			for(list<Genome>::iterator
+				iterGenome = (*iterSpecies)->genomes.begin();
+				iterGenome != (*iterSpecies)->genomes.end();
+				iterGenome++)
+				if( !iterGenome->culled and !iterGenome->cachedFitness )
+				{
+					if(!iterGenome->phenotype.compiled) iterGenome->phenotype.Compile(*iterGenome);
+					size_t b = 0;
+					if(gm_batchTopologies)
+						while( (b < batches.size()) and ( (batches[b].size() == BatchLanes()) 
+								or !SameTopology(batches[b][0]->phenotype, iterGenome->phenotype) ) )
+							b++;
+					else
+						b = batches.size();
+					if(b == batches.size()) { batches.push_back(vector<Genome*>()); cutoffs.push_back(vector<double>()); }
+					batches[b].push_back(&*iterGenome);
+					cutoffs[b].push_back(cull ? (*iterSpecies)->survivalError : INFINITY);
+				}
+
+		if( gm_batchTopologies and (tile == 0) )
+		{
+			pthread_mutex_lock(&g_batchLock);
+			for(size_t b = 0; b < batches.size(); b++)
+			{
+				g_batchGenomes += batches[b].size();
+				if(batches[b].size() > 1)
+					{ g_batchBatched += batches[b].size(); g_batchBatches++; }
+			}
+			pthread_mutex_unlock(&g_batchLock);
+		}
+
+		// Errors only grow, so a genome past the cutoff (or at infinity) stays there: stop evaluating it.
+		for(size_t b = 0; b < batches.size(); b++)
+		{
+			if(batches[b].size() > 1)
+				AccumulateBatchError(batches[b].data(), batches[b].size(), database, &segments[tile], tileEnd - tile);
+			else
+				batches[b][0]->AccumulateError(database, &segments[tile], tileEnd - tile, &batches[b][0]->sse);
+
+			for(size_t g = 0; g < batches[b].size(); g++)
+				if( !boost::math::isfinite(batches[b][g]->sse) or (batches[b][g]->sse > cutoffs[b][g]) )
+				{
+					batches[b][g]->culled = true;
+					batches[b][g]->culledAfter = tileEnd;
+				}
+		}
+	}
 }
 
 
@@ -1057,7 +2182,7 @@ void Population::PrintSpeciesSize(ostream& outstream)
 
 
 
-void Population::PrintFitness(ostream& outstream, vector<DataEntry>* database1, vector<DataEntry>* database2)
+void Population::PrintFitness(ostream& outstream, const Dataset* database1, const Dataset* database2)
 {
 	outstream << setw(6) << g_generationNumber 
 				<< ',' << fixed << setprecision(25) << superChampion->GetFitness(database1);
@@ -1067,3 +2192,15 @@ void Population::PrintFitness(ostream& outstream, vector<DataEntry>* database1,
 	
 	outstream	<< '\n';
 }
+
+
+void Population::PrintFitness(ostream& outstream, DatabaseStream* stream1, DatabaseStream* stream2)
+{
+	outstream << setw(6) << g_generationNumber 
+				<< ',' << fixed << setprecision(25) << superChampion->GetFitness(stream1);
+	
+	if(stream2)
+		outstream	<< ',' << fixed << setprecision(25) << superChampion->GetFitness(stream2);
+	
+	outstream	<< '\n';
+}
@@ -0,0 +1,262 @@
+/* Andre Braga Reis, 2016
+ */
+
+#include "native.h"
+#include "genetic.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <iomanip>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+
+static string g_nativeCache = "";
+static map<uint64_t, NativeActivation> g_nativeModules;
+static set<uint64_t> g_nativeBuilding;
+static pthread_mutex_t g_nativeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_nativeBuilt = PTHREAD_COND_INITIALIZER;
+static uint32_t g_nativeCompiled = 0;
+static uint32_t g_nativeCached = 0;
+static bool g_nativeFailureReported = false;
+
+
+void SetNativeCache(string directory)
+{
+	if( (mkdir(directory.c_str(), 0755) != 0) and (errno != EEXIST) )
+		{ cout << "\nERROR\tCould not create the native cache directory " << directory << "." << endl; exit(1); }
+	g_nativeCache = directory;
+}
+
+
+// Everything the generated code depends on: the inputs, and every instruction with its operands.
+static uint64_t StructuralHash(const Phenotype& phenotype)
+{
+	uint64_t hash = NEATRSU_HASH_SEED;
+	HashBytes(&hash, NATIVE_COMPILER, strlen(NATIVE_COMPILER));
+	HashBytes(&hash, &g_inputs, sizeof(g_inputs));
+	for(vector<Phenotype::Instruction>::const_iterator
+		iterCode = phenotype.code.begin();
+		iterCode != phenotype.code.end();
+		iterCode++)
+	{
+		HashBytes(&hash, &iterCode->op, sizeof(iterCode->op));
+		HashBytes(&hash, &iterCode->node, sizeof(iterCode->node));
+		HashBytes(&hash, &iterCode->count, sizeof(iterCode->count));
+		for(uint16_t c = 0; c < iterCode->count; c++)
+		{
+			HashBytes(&hash, &phenotype.sources[iterCode->operand + c], sizeof(uint16_t));
+			HashBytes(&hash, &phenotype.weights[iterCode->operand + c], sizeof(double));
+		}
+	}
+	return hash;
+}
+
+
+// The bytecode as a C function, one statement per connection. Weights are written exactly, in hex.
+static string GenerateSource(const Phenotype& phenotype)
+{
+	stringstream source;
+	source	<< "/* neatRSU native activation: generated, do not edit. */\n\n"
+			<< "double " << NATIVE_SYMBOL << "(const float* features, double* last, double* now,\n"
+			<< "\tdouble (*sigmoid)(double), double (*output)(double))\n"
+			<< "{\n"
+			<< "\tdouble sum;\n" << hexfloat;
+
+	for(vector<Phenotype::Instruction>::const_iterator
+		iterCode = phenotype.code.begin();
+		iterCode != phenotype.code.end();
+		iterCode++)
+		switch(iterCode->op)
+		{
+			case Phenotype::OP_INPUTS:
+				for(uint16_t n = 0; n < g_inputs; n++)
+					source << "\tlast[" << n << "] = features[" << n << "];\n";
+				source << "\tlast[" << iterCode->node << "] = 1.0;\n\tnow[" << iterCode->node << "] = 1.0;\n";
+				break;
+
+			case Phenotype::OP_OUTPUT:
+				source	<< "\tnow[" << iterCode->node << "] = output(now[" << iterCode->node << "]);\n"
+						<< "\treturn now[" << iterCode->node << "];\n";
+				break;
+
+			default:
+				source << "\tsum = 0.0;\n";
+				for(uint16_t c = 0; c < iterCode->count; c++)
+					source	<< "\tsum += last[" << phenotype.sources[iterCode->operand + c] << "] * ("
+							<< phenotype.weights[iterCode->operand + c] << ");\n";
+				if( (iterCode->op == Phenotype::OP_ACCUMULATE_SIGMOID) or (iterCode->op == Phenotype::OP_RUN_SIGMOID) )
+					source << "\tnow[" << iterCode->node << "] = sigmoid(sum);\n";
+				else
+					source << "\tnow[" << iterCode->node << "] = sum;\n";
+				break;
+		}
+
+	source << "}\n";
+	return source.str();
+}
+
+
+// Run the compiler on 'source' into 'object', without a shell, so paths are taken as they are.
+// Returns an empty string on success, or what went wrong.
+static string RunCompiler(string source, string object)
+{
+	vector<string> words;
+	istringstream compiler(NATIVE_COMPILER);
+	for(string word; compiler >> word; )
+		words.push_back(word);
+	words.push_back("-o");
+	words.push_back(object);
+	words.push_back(source);
+
+	vector<char*> argv;
+	for(vector<string>::iterator
+		iterWord = words.begin();
+		iterWord != words.end();
+		iterWord++)
+		argv.push_back(&(*iterWord)[0]);
+	argv.push_back(0);
+
+	pid_t child = fork();
+	if(child < 0)
+		return string("could not start ") + argv[0] + ": " + strerror(errno);
+	if(child == 0)
+	{
+		// The compiler's own diagnostics would interleave with the training output.
+		int devnull = open("/dev/null", O_WRONLY);
+		if(devnull >= 0) { dup2(devnull, STDOUT_FILENO); dup2(devnull, STDERR_FILENO); }
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+
+	int status;
+	while(waitpid(child, &status, 0) < 0)
+		if(errno != EINTR)
+			return string("lost ") + argv[0] + ": " + strerror(errno);
+	if( WIFEXITED(status) and (WEXITSTATUS(status) == 127) )
+		return string("could not run ") + argv[0];
+	if( !WIFEXITED(status) or (WEXITSTATUS(status) != 0) )
+		return string(argv[0]) + " failed";
+	return "";
+}
+
+
+// True if a file holds a whole shared object: an ELF header, and everything up to the section headers
+// that end the file. A file cut short by an interrupted build or copy is not handed to dlopen().
+static bool CompleteObject(string filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+	Elf64_Ehdr header;
+	struct stat fileStat;
+	bool complete = (read(fd, &header, sizeof(header)) == sizeof(header)) and (fstat(fd, &fileStat) == 0)
+		and (memcmp(header.e_ident, ELFMAG, SELFMAG) == 0) and (header.e_ident[EI_CLASS] == ELFCLASS64)
+		and ( (uint64_t)fileStat.st_size >= header.e_shoff + (uint64_t)header.e_shnum*header.e_shentsize );
+	close(fd);
+	return complete;
+}
+
+
+// Load the activation from a shared object. Returns 0 if it is missing or broken.
+static NativeActivation OpenModule(string filename)
+{
+	if(!CompleteObject(filename)) return 0;
+	void* module = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if(!module) return 0;
+	NativeActivation activation = (NativeActivation)dlsym(module, NATIVE_SYMBOL);
+	if(!activation) dlclose(module);
+	return activation;
+}
+
+
+NativeActivation LoadNativeActivation(const Phenotype& phenotype)
+{
+	if(g_nativeCache.empty()) SetNativeCache(NATIVE_DEFAULT_CACHE);
+
+	uint64_t hash = StructuralHash(phenotype);
+	pthread_mutex_lock(&g_nativeLock);
+
+	// Being built by another thread: wait for it, rather than compile it twice.
+	while(g_nativeBuilding.count(hash))
+		pthread_cond_wait(&g_nativeBuilt, &g_nativeLock);
+
+	// Loaded already this run.
+	map<uint64_t, NativeActivation>::const_iterator iterModule = g_nativeModules.find(hash);
+	if(iterModule != g_nativeModules.end())
+		{ pthread_mutex_unlock(&g_nativeLock); return iterModule->second; }
+
+	// Build it outside the lock, so other threads keep evaluating.
+	g_nativeBuilding.insert(hash);
+	pthread_mutex_unlock(&g_nativeLock);
+
+	stringstream name;
+	name << g_nativeCache << '/' << hex << setw(16) << setfill('0') << hash;
+	string object = name.str() + ".so";
+
+	/* Compiled on an earlier run, or compile it now. cc writes under a temporary name, and the object
+	 * is renamed into place only once it succeeded, so concurrent runs sharing a cache never load a
+	 * partial one. An object that is there but incomplete anyway (left by a copy, or an older build)
+	 * is not loaded, and is replaced.
+	 */
+	bool cached = false;
+	string failure = "";
+	NativeActivation activation = OpenModule(object);
+	if(activation)
+		cached = true;
+	else
+	{
+		stringstream temporary;
+		temporary << name.str() << '.' << getpid();
+		string source = temporary.str() + ".c";
+		ofstream sourceFile(source.c_str());
+		sourceFile << GenerateSource(phenotype);
+		sourceFile.close();
+
+		if(!sourceFile)
+			failure = "could not write " + source;
+		else
+			failure = RunCompiler(source, temporary.str() + ".so");
+		if( failure.empty() and (rename((temporary.str() + ".so").c_str(), object.c_str()) != 0) )
+			failure = "could not move it into place: " + string(strerror(errno));
+		if(failure.empty())
+		{
+			activation = OpenModule(object);
+			if(!activation) failure = "could not load it";
+		}
+		unlink(source.c_str());
+		unlink((temporary.str() + ".so").c_str());
+	}
+
+	// Failures are remembered too, so they are not retried. The first is reported.
+	pthread_mutex_lock(&g_nativeLock);
+	if(cached) g_nativeCached++;
+	else if(activation) g_nativeCompiled++;
+	else if( !g_nativeFailureReported or gm_debug )
+	{
+		cout << "INFO\tCould not compile native module " << object << " (" << failure 
+			 << "). Networks that cannot be compiled run interpreted." << endl;
+		g_nativeFailureReported = true;
+	}
+	g_nativeModules[hash] = activation;
+	g_nativeBuilding.erase(hash);
+	pthread_cond_broadcast(&g_nativeBuilt);
+	pthread_mutex_unlock(&g_nativeLock);
+	return activation;
+}
+
+
+void GetNativeStats(uint32_t* compiled, uint32_t* cached)
+{
+	pthread_mutex_lock(&g_nativeLock);
+	*compiled = g_nativeCompiled;
+	*cached = g_nativeCached;
+	pthread_mutex_unlock(&g_nativeLock);
+}
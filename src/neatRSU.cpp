@@ -3,6 +3,9 @@
 
 #include "neatRSU.h"
 #include "genetic.h"
+#include "dataset.h"
+
+#include <unistd.h>
 
 // Debug flag
 uint16_t gm_debug = 0;
@@ -10,7 +13,7 @@ uint16_t gm_debug = 0;
 // Global generation counter
 uint32_t g_generationNumber = 0;
 
-const uint16_t g_inputs = 6;
+uint16_t g_inputs = 6;
 map<uint16_t,string> g_nodeNames = 
 {
 	{1, "id"},
@@ -21,7 +24,7 @@ map<uint16_t,string> g_nodeNames =
 	{6, "bearing"},
 	{7, "output"},
 	{8, "bias"}
-};/* Number of inputs in the system and node names
+};/* Number of inputs in the system and node names (by default; set from the input schema)
  * g_inputs+1 -> output node
  * g_inputs+2 -> bias node
  * g_inputs+3 -> first hidden node
@@ -35,6 +38,13 @@ float gm_compat_excess 		= 1.0;
 float gm_compat_disjoint 	= 1.0;
 float gm_compat_weight 		= 0.4;	// flip to 3.0 for a larger population (e.g. 1000)
 bool  gm_limitInitialGrowth = false;
+uint16_t gm_lanes			= 0;	// Vehicles evaluated at once, in SIMD lanes. 0 picks the widest the CPU supports.
+Evaluator gm_evaluator		= Evaluator::PHENOTYPE;
+Precision gm_precision		= Precision::DOUBLE;
+uint32_t gm_nativeAfter		= 0;	// Generations a genome goes unchanged before it is compiled to native code. 0 never does.
+bool gm_fitnessCache		= false;	// Reuse the error of networks already evaluated on all the training data.
+bool gm_batchTopologies		= false;	// Run genomes of the same topology together, a genome per SIMD lane.
+uint16_t gm_genomeThreads	= 1;	// Threads evaluating one genome at a time in GetFitness (testing, champions).
 
 float g_m_p_mutate_weights 			= 0.80;
 float g_m_p_weight_perturb_or_new 	= 0.90;
@@ -50,10 +60,26 @@ boost::random::mt19937 						g_rng;
 boost::random::normal_distribution<> 		g_rnd_gauss;
 
 
+// Size the network's inputs, and the IDs of the nodes after them, to an input schema.
+static void SetInputSchema(const FeatureSchema& schema)
+{
+	g_inputs = schema.features.size();
+	d_outputnode = g_inputs+1;
+	d_biasnode = g_inputs+2;
+	d_firsthidnode = g_inputs+3;
+
+	g_nodeNames.clear();
+	for(uint16_t n = 0; n < g_inputs; n++)
+		g_nodeNames[n+1] = schema.features[n].name;
+	g_nodeNames[d_outputnode] = "output";
+	g_nodeNames[d_biasnode] = "bias";
+}
+
+
 int main(int argc, char *argv[])
 {
 	/* Overall structure:
-	 * - Load data into memory, from CSV files, using Boost::tokenizer
+	 * - Load data into memory, from memory-mapped CSV files
 	 * - Set up neural network scaffolds for genetic evolution
 	 * - Evolve network on training data, until criteria met or user input
 	 * - Output resulting network structure and weights
@@ -83,12 +109,32 @@ int main(int argc, char *argv[])
 	uint16_t 	m_maxPop				= 150;
 	string 		m_speciationAlgo		= "preserveSpecies";
 	bool		m_seedGenome			= false;
+	bool		m_datasetCache			= false;
+	uint32_t	m_streamBlockMB			= 0;
+	string		m_evaluator				= "phenotype";
+	string		m_precision				= "double";
+	string		m_inputSchema			= DATASET_DEFAULT_SCHEMA;
+	string		m_publishDataset		= "";
+	string		m_attachDataset			= "";
+	bool		m_compressData			= false;
+	bool		m_compactSamples		= false;
+	string		m_compactTolerances		= "";
+	bool		m_follow				= false;
+	uint32_t	m_windowVehicles		= 10000;
+	uint32_t	m_windowSeconds			= 0;
+	uint64_t	m_windowEntries			= 0;
+	uint32_t	m_tripGap				= 0;
+	float		m_fitnessSample			= 1.0;
+	uint32_t	m_fullEvalEvery			= 10;
+	uint32_t	m_coarseToFine			= 1;
+	uint32_t	m_resolutionPatience	= 5;
 	bool 		m_printPopulation		= false;
 	string 		m_printPopulationFile 	= "";
 	string 		m_printSpeciesStackFile = "";
 	string 		m_printSpeciesSizeFile  = "";
 	string 		m_printFitnessFile		= "";
 	bool		m_printSuperChampions	= false;
+	bool		m_pruneExports			= false;
 	float		m_weightPerturbStdev	= FLT_MAX;
 	uint32_t	m_killStagnated			= 0;
 	uint32_t	m_refocusStagnated		= 0;
@@ -102,8 +148,32 @@ int main(int argc, char *argv[])
 	boost::program_options::options_description cliOptDesc("Options");
 	cliOptDesc.add_options()
 		("threads", 				boost::program_options::value<uint16_t>(),	"number of threads to run concurrently")
+		("evaluator", 				boost::program_options::value<string>(), 	"activate genomes by their 'phenotype' (default), 'bytecode', or 'verify' that both agree")
+		("lanes", 					boost::program_options::value<uint16_t>(),	"vehicles each genome evaluates at once in SIMD lanes: 1, 2, 4 or 8 (default: widest supported)")
+		("precision", 				boost::program_options::value<string>(), 	"evaluate fitness in 'double' (default) or 'float', with twice the lanes and an approximate sigmoid")
+		("batch-topologies", 														"run the genomes of a species that share a topology together, one per SIMD lane, and report how many do")
+		("genome-threads", 			boost::program_options::value<uint16_t>(),	"threads that share each single genome evaluation, such as --test-genome and champions (default: 1)")
+		("fitness-cache", 															"reuse the fitness of networks already scored on all the training data, and report the hit rate")
+		("native-after", 			boost::program_options::value<uint32_t>(),	"compile genomes that survive this many generations unchanged to native code with the system's cc")
+		("native-cache", 			boost::program_options::value<string>(), 	"directory of compiled native genomes, shared between runs (default: " NATIVE_DEFAULT_CACHE ")")
 		("train-data", 				boost::program_options::value<string>(), 	"location of training data CSV")
 		("test-data", 				boost::program_options::value<string>(), 	"location of test data CSV")
+		("dataset-cache", 														"load data from (and create) binary .nrsu caches of the CSVs")
+		("stream-data", 			boost::program_options::value<uint32_t>(),	"stream data from .nrsu caches in blocks of N MB, instead of loading it")
+		("follow", 																"keep training on entries appended to --train-data (a file, or a spool directory)")
+		("window-vehicles", 		boost::program_options::value<uint32_t>(),	"with --follow, train on the N most recently seen vehicles (default 10000)")
+		("window-seconds", 			boost::program_options::value<uint32_t>(),	"with --follow, train on the last N seconds of relative_time (default 0: no time limit)")
+		("window-entries", 			boost::program_options::value<uint64_t>(),	"with --follow, train on at most about the N most recent entries (default 0, no limit)")
+		("trip-gap", 				boost::program_options::value<uint32_t>(),	"split a vehicle's samples more than N seconds apart into separate trips (default 300 with --follow, otherwise 0: never)")
+		("publish-dataset", 		boost::program_options::value<string>(), 	"publish the loaded databases (and features) in shared memory as NAME.train and NAME.test")
+		("attach-dataset", 			boost::program_options::value<string>(), 	"use the databases published as NAME, instead of --train-data and --test-data")
+		("compact-samples", 		boost::program_options::value<string>()->implicit_value(""), "merge consecutive training samples of a vehicle with the same position, speed and heading, or within tolerances such as latitude=1e-5,longitude=1e-5,speed=1,heading=-1 (-1 leaves a column out)")
+		("compress-data", 														"keep the databases in memory delta/varint-compressed, decoding them as they are evaluated")
+		("fitness-sample", 			boost::program_options::value<float>(),		"score genomes on a random fraction of the vehicles, redrawn every generation")
+		("full-eval-every", 		boost::program_options::value<uint32_t>(),	"with --fitness-sample, score on all the data every N generations (default 10)")
+		("coarse-to-fine", 			boost::program_options::value<uint32_t>(),	"score genomes on every N-th sample of each vehicle at first, refining as the best fitness plateaus")
+		("resolution-patience", 	boost::program_options::value<uint32_t>(),	"with --coarse-to-fine, refine after N generations without improvement (default 5)")
+		("inputs", 					boost::program_options::value<string>(), 	"input schema, e.g. node_id,relative_time:delta,latitude:zscore,speed:scale=0.1")
 		("genome-file", 			boost::program_options::value<string>(), 	"load a genome from a CSV file")
 		("seed-genome", 														"uses the loaded genome as the first seed")
 		("test-genome", 														"runs the loaded genome on the databases")
@@ -125,6 +195,7 @@ int main(int argc, char *argv[])
 		("print-speciessize-file", 	boost::program_options::value<string>(), 	"print CSV-formatted sizes of species per generation")
 		("print-fitness-file", 		boost::program_options::value<string>(), 	"print best fitness to a file")
 		("print-super-champions", 											 	"print every super champion to a file")
+		("prune-exports", 													 	"save and draw champions without the nodes and connections that cannot affect the output")
 	    ("debug", 					boost::program_options::value<uint16_t>(),	"enable debug mode")
 	    ("help", 																"give this help list")
 	;
@@ -139,8 +210,33 @@ int main(int argc, char *argv[])
 	// Process options
 	if (varMap.count("debug")) 					gm_debug					= varMap["debug"].as<uint16_t>();
 	if (varMap.count("threads")) 				m_threads					= varMap["threads"].as<uint16_t>();
+	if (varMap.count("lanes")) 					gm_lanes					= varMap["lanes"].as<uint16_t>();
+	if (varMap.count("evaluator"))				m_evaluator					= varMap["evaluator"].as<string>();
+	if (varMap.count("precision"))				m_precision					= varMap["precision"].as<string>();
+	if (varMap.count("batch-topologies"))		gm_batchTopologies			= true;
+	if (varMap.count("genome-threads"))			gm_genomeThreads			= varMap["genome-threads"].as<uint16_t>();
+	if (varMap.count("fitness-cache"))			gm_fitnessCache				= true;
+	if (varMap.count("native-after"))			gm_nativeAfter				= varMap["native-after"].as<uint32_t>();
+	if (varMap.count("native-cache"))			SetNativeCache(varMap["native-cache"].as<string>());
 	if (varMap.count("train-data"))				m_traindata					= varMap["train-data"].as<string>();
 	if (varMap.count("test-data"))				m_testdata					= varMap["test-data"].as<string>();
+	if (varMap.count("dataset-cache"))			m_datasetCache				= true;
+	if (varMap.count("stream-data"))			m_streamBlockMB				= varMap["stream-data"].as<uint32_t>();
+	if (varMap.count("publish-dataset"))		m_publishDataset			= varMap["publish-dataset"].as<string>();
+	if (varMap.count("attach-dataset"))			m_attachDataset				= varMap["attach-dataset"].as<string>();
+	if (varMap.count("compress-data"))			m_compressData				= true;
+	if (varMap.count("compact-samples"))		{ m_compactSamples = true; m_compactTolerances = varMap["compact-samples"].as<string>(); }
+	if (varMap.count("follow"))					m_follow					= true;
+	if (varMap.count("window-vehicles"))		m_windowVehicles			= varMap["window-vehicles"].as<uint32_t>();
+	if (varMap.count("window-seconds"))			m_windowSeconds				= varMap["window-seconds"].as<uint32_t>();
+	if (varMap.count("window-entries"))			m_windowEntries				= varMap["window-entries"].as<uint64_t>();
+	if (varMap.count("trip-gap"))				m_tripGap					= varMap["trip-gap"].as<uint32_t>();
+	else if(m_follow)							m_tripGap					= 300;
+	if (varMap.count("fitness-sample"))			m_fitnessSample				= varMap["fitness-sample"].as<float>();
+	if (varMap.count("full-eval-every"))		m_fullEvalEvery				= varMap["full-eval-every"].as<uint32_t>();
+	if (varMap.count("coarse-to-fine"))			m_coarseToFine				= varMap["coarse-to-fine"].as<uint32_t>();
+	if (varMap.count("resolution-patience"))	m_resolutionPatience		= varMap["resolution-patience"].as<uint32_t>();
+	if (varMap.count("inputs"))					m_inputSchema				= varMap["inputs"].as<string>();
 	if (varMap.count("genome-file"))			m_genomeFile				= varMap["genome-file"].as<string>();
 	if (varMap.count("test-genome")) 			m_testGenome				= true;
 	if (varMap.count("seed"))					m_seed						= varMap["seed"].as<int>();
@@ -162,17 +258,94 @@ int main(int argc, char *argv[])
 	if (varMap.count("print-speciessize-file"))		m_printSpeciesSizeFile 	= varMap["print-speciessize-file"].as<string>();
 	if (varMap.count("print-fitness-file"))			m_printFitnessFile 		= varMap["print-fitness-file"].as<string>();
 	if (varMap.count("print-super-champions"))		m_printSuperChampions 	= true;
+	if (varMap.count("prune-exports"))				m_pruneExports 			= true;
 
 	if (varMap.count("help")) 					{ cout << cliOptDesc; return 1; }
 
 	if(m_refocusStagnated>m_killStagnated)
 		{cout << "ERROR --refocus-stagnated must be inferior to --kill-stagnated."; exit(1); }
 
+	if( (gm_lanes != 0) and (gm_lanes != 1) and (gm_lanes != 2) and (gm_lanes != 4) and (gm_lanes != 8) )
+		{cout << "ERROR --lanes must be 1, 2, 4 or 8."; exit(1); }
+	if(m_evaluator == "phenotype")		gm_evaluator = Evaluator::PHENOTYPE;
+	else if(m_evaluator == "bytecode")	gm_evaluator = Evaluator::BYTECODE;
+	else if(m_evaluator == "verify")	gm_evaluator = Evaluator::VERIFY;
+	else
+		{cout << "ERROR --evaluator must be 'phenotype', 'bytecode' or 'verify'."; exit(1); }
+
+	// Lanes run the phenotype: the other evaluators go one vehicle at a time.
+	if( (gm_evaluator != Evaluator::PHENOTYPE) and (gm_lanes > 1) )
+		{cout << "ERROR --evaluator " << m_evaluator << " cannot be used with --lanes."; exit(1); }
+	if(gm_evaluator != Evaluator::PHENOTYPE)
+		gm_lanes = 1;
+
+	if(m_precision == "double")		gm_precision = Precision::DOUBLE;
+	else if(m_precision == "float")	gm_precision = Precision::FLOAT;
+	else
+		{cout << "ERROR --precision must be 'double' or 'float'."; exit(1); }
+
+	// Single precision runs only in lanes, from the phenotype.
+	if( (gm_precision == Precision::FLOAT) and (gm_evaluator != Evaluator::PHENOTYPE) )
+		{cout << "ERROR --precision float cannot be used with --evaluator " << m_evaluator << "."; exit(1); }
+	if( (gm_precision == Precision::FLOAT) and gm_nativeAfter )
+		{cout << "ERROR --precision float cannot be used with --native-after."; exit(1); }
+	if(gm_lanes == 0)
+		gm_lanes = SupportedLanes();
+	else if(gm_lanes > SupportedLanes())
+		{cout << "ERROR --lanes " << gm_lanes << " needs instructions this CPU lacks: use at most " << SupportedLanes() << "."; exit(1); }
+	if( gm_batchTopologies and (gm_lanes < 2) )
+		{cout << "ERROR --batch-topologies needs at least 2 lanes, and the phenotype evaluator."; exit(1); }
+
 	if(m_seedGenome and m_genomeFile.empty())
 		{cout << "ERROR --seed-genome requires --genome-file."; exit(1); }
 
+	if(varMap.count("stream-data") and (m_streamBlockMB<1))
+		{cout << "ERROR --stream-data requires a block size of at least 1 MB."; exit(1); }
+
+	if( m_follow and (m_streamBlockMB or m_datasetCache) )
+		{cout << "ERROR --follow cannot be used with --stream-data or --dataset-cache."; exit(1); }
+
+	if( !m_publishDataset.empty() and (m_streamBlockMB or m_follow) )
+		{cout << "ERROR --publish-dataset cannot be used with --stream-data or --follow."; exit(1); }
+
+	if( !m_attachDataset.empty() and ( !m_traindata.empty() or !m_testdata.empty() or m_streamBlockMB or m_follow 
+			or m_datasetCache or varMap.count("inputs") or !m_publishDataset.empty() ) )
+		{cout << "ERROR --attach-dataset replaces --train-data, --test-data and --inputs, and cannot be used to load or publish data."; exit(1); }
+
+	if( m_compressData and m_streamBlockMB )
+		{cout << "ERROR --compress-data cannot be used with --stream-data."; exit(1); }
+
+	if( m_compactSamples and m_streamBlockMB )
+		{cout << "ERROR --compact-samples cannot be used with --stream-data."; exit(1); }
+
+	if( m_follow and (m_windowVehicles<1) )
+		{cout << "ERROR --window-vehicles must be at least 1."; exit(1); }
+
+	// node_id is reused: its samples far apart in time are different trips.
+	SetTripGap(m_tripGap);
+
+	// Following data, evolution goes on until stopped, unless told otherwise.
+	if( m_follow and !varMap.count("generations") )
+		m_genmax = UINT32_MAX;
+
+	if( !(m_fitnessSample > 0) or (m_fitnessSample > 1) )
+		{cout << "ERROR --fitness-sample must be a fraction in (0,1]."; exit(1); }
+
+	if(m_fullEvalEvery<1)
+		{cout << "ERROR --full-eval-every must be at least 1."; exit(1); }
+
+	if( (m_coarseToFine<1) or (m_resolutionPatience<1) )
+		{cout << "ERROR --coarse-to-fine and --resolution-patience must be at least 1."; exit(1); }
+
 	if( (m_threads<1) or (m_threads>32) )
 		{cout << "ERROR --threads must be between 1 and 32."; exit(1); }
+	if( (gm_genomeThreads<1) or (gm_genomeThreads>32) )
+		{cout << "ERROR --genome-threads must be between 1 and 32."; exit(1); }
+
+	// Input features, and the network inputs they map to.
+	FeatureSchema inputSchema;
+	inputSchema.Parse(m_inputSchema);
+	SetInputSchema(inputSchema);
 
 	if(m_speciationAlgo == "bestCompat")
 		cout << "INFO\tSelected 'bestCompat' speciation algorithm.\n";
@@ -187,38 +360,96 @@ int main(int argc, char *argv[])
 	 ***/
 
 
-	// Database to store training data
-	vector<DataEntry> TrainingDB;
+	// Databases to store training and test data
+	Dataset TrainingDB;
+	Dataset TestDB;
+
+	// With --stream-data, the databases stay on disk and are read a block at a time instead.
+	DatabaseStream TrainingStream;
+	DatabaseStream TestStream;
+	uint64_t streamBlockBytes = (uint64_t)m_streamBlockMB << 20;
+
+	// With --follow, the training data is a sliding window over a growing file, kept as entries to append to.
+	DatabaseFollower TrainingFollower;
+	vector<DataEntry> TrainingWindow;
+
+	// The test data is loaded on its own thread while the training data loads (see A2).
+	pthread_t testLoadThread;
+	threadDataLoadDatabase testLoad;
+	if( !m_testdata.empty() and !m_streamBlockMB )
+	{
+		testLoad.filename = m_testdata;
+		testLoad.database = &TestDB;
+		testLoad.useCache = m_datasetCache;
+		testLoad.threads = m_threads;
+		int rc = pthread_create(&testLoadThread, NULL, ThreadLoadDatabase, (void *)&testLoad);
+		assert(rc == 0);
+	}
+
+	if(!m_attachDataset.empty())
+	{
+	 	cout << "INFO\tAttaching shared dataset " << m_attachDataset << "... " << flush;
+
+		// The features come computed, with the schema they were computed with.
+		string schemaText;
+		if(!AttachDataset(m_attachDataset + ".train", &TrainingDB, &schemaText))
+			{ cout << "\nERROR\tNo shared dataset " << m_attachDataset << ".train." << endl; exit(1); }
+		inputSchema.Parse(schemaText);
+		SetInputSchema(inputSchema);
+
+		if(AttachDataset(m_attachDataset + ".test", &TestDB, &schemaText))
+			m_testdata = m_attachDataset + ".test";
 
-	if(m_traindata.empty())
+		cout << "done." << endl;
+		cout << "INFO\tAttached " << TrainingDB.size << " training entries (" << TrainingDB.segments.size() << " vehicles)";
+		if(!m_testdata.empty())
+			cout << " and " << TestDB.size << " testing entries (" << TestDB.segments.size() << " vehicles)";
+		cout << '.' << endl;
+	}
+	else if(m_traindata.empty())
 		{ cout << "ERROR\tPlease specify a file with training data." << endl; exit(1); }
-	else
+	else if(m_follow)
 	{
-	 	cout << "INFO\tLoading training data on " << m_traindata << " into memory... " << flush;
+	 	cout << "INFO\tFollowing training data on " << m_traindata << "... " << flush;
 
-		ifstream trainDataIn( m_traindata.c_str() );
-		if (!trainDataIn.is_open()) { cout << "\nERROR\tFailed to open file." << endl; exit(1); }
+		if(!TrainingFollower.Open(m_traindata))
+			{ cout << "\nERROR\tFailed to open file." << endl; exit(1); }
+		uint64_t bytes = TrainingFollower.Poll(&TrainingWindow, m_threads);
+		while(TrainingWindow.empty())
+			{ sleep(1); bytes += TrainingFollower.Poll(&TrainingWindow, m_threads); }
 
-		// Setup boost::tokenizer
-		vector<string> fields; string line;
-		while (getline(trainDataIn,line))
-		{
-			// Tokenize the line into 'fields'
-			boost::tokenizer< boost::escaped_list_separator<char> > tok(line);
-			fields.assign(tok.begin(),tok.end());
+		SlideDatabaseWindow(&TrainingWindow, m_windowVehicles, m_windowSeconds, m_windowEntries);
+		SortDatabase(&TrainingWindow, m_threads);
+		TrainingDB.Assign(TrainingWindow);
 
-	        // Create an entry from the tokenized string vector
-	        // DataEntry constructor automatically converts strings to the correct types 
-			DataEntry entry(fields);
-			TrainingDB.push_back(entry);
-		}
+		cout << "done." << endl;
+		cout << "INFO\tLoaded " << TrainingDB.size << " training entries (" << TrainingDB.segments.size() << " trips) into the window"
+			 << " (" << fixed << setprecision(1) << bytes/1e6 << " MB)." << defaultfloat << setprecision(6) << endl;
+	}
+	else if(m_streamBlockMB)
+	{
+	 	cout << "INFO\tPreparing training data on " << m_traindata << " for streaming... " << flush;
+
+		DatabaseLoadStats loadStats = StreamDatabase(m_traindata, &TrainingStream, streamBlockBytes, m_threads);
 
-		trainDataIn.close();
 		cout << "done." << endl;
-		cout << "INFO\tLoaded " << TrainingDB.size() << " training entries into memory." << endl;
+		if(loadStats.cacheWritten)
+			cout << "INFO\tWrote dataset cache " << m_traindata << ".nrsu." << endl;
+		cout << "INFO\tStreaming " << TrainingStream.entries << " training entries in blocks of " << m_streamBlockMB << " MB." << endl;
+	}
+	else
+	{
+	 	cout << "INFO\tLoading training data on " << m_traindata << " into memory... " << flush;
 
-		// Sort TrainingData by NodeID, then Time.
-		sort(TrainingDB.begin(), TrainingDB.end(), sortIdThenTime);
+		DatabaseLoadStats loadStats = LoadDatabase(m_traindata, &TrainingDB, m_datasetCache, m_threads);
+
+		cout << "done." << endl;
+		cout << "INFO\tLoaded " << TrainingDB.size << " training entries (" << TrainingDB.segments.size() << " vehicles) into memory"
+			 << (loadStats.fromCache ? " from the dataset cache" : "")
+			 << " (" << fixed << setprecision(1) << loadStats.bytes/1e6 << " MB at " << loadStats.bytes/1e6/loadStats.seconds << " MB/s)." 
+			 << defaultfloat << setprecision(6) << endl;
+		if(loadStats.cacheWritten)
+			cout << "INFO\tWrote dataset cache " << m_traindata << ".nrsu." << endl;
 	}
 
 
@@ -228,41 +459,71 @@ int main(int argc, char *argv[])
 	 ***/
 
 
-	// Database to store training data
-	vector<DataEntry> TestDB;
-
 	// Check if a test data file was specified in the options.
 	if(m_testdata.empty())
 		{ cout << "INFO\tNo test data provided, evaluation to be performed on training data only." << endl; }
+	else if(!m_attachDataset.empty())
+		{ } // Attached in A1.
+	else if(m_streamBlockMB)
+	{
+	 	cout << "INFO\tPreparing test data on " << m_testdata << " for streaming... " << flush;
+
+		DatabaseLoadStats loadStats = StreamDatabase(m_testdata, &TestStream, streamBlockBytes, m_threads);
+
+		cout << "done." << endl;
+		if(loadStats.cacheWritten)
+			cout << "INFO\tWrote dataset cache " << m_testdata << ".nrsu." << endl;
+		cout << "INFO\tStreaming " << TestStream.entries << " testing entries in blocks of " << m_streamBlockMB << " MB." << endl;
+	}
 	else
 	{
-		// Load data
+		// Wait for the loading thread started in A1.
 	 	cout << "INFO\tLoading test data on " << m_testdata << " into memory... " << flush;
 
-		ifstream testDataIn( m_testdata.c_str() );
-		if (!testDataIn.is_open()) { cout << "\nERROR\tFailed to open file." << endl; exit(1); }
+		int rc = pthread_join(testLoadThread, NULL);
+		assert(rc == 0);
+		DatabaseLoadStats& loadStats = testLoad.stats;
 
+		cout << "done." << endl;
+		cout << "INFO\tLoaded " << TestDB.size << " testing entries (" << TestDB.segments.size() << " vehicles) into memory"
+			 << (loadStats.fromCache ? " from the dataset cache" : "")
+			 << " (" << fixed << setprecision(1) << loadStats.bytes/1e6 << " MB at " << loadStats.bytes/1e6/loadStats.seconds << " MB/s)." 
+			 << defaultfloat << setprecision(6) << endl;
+		if(loadStats.cacheWritten)
+			cout << "INFO\tWrote dataset cache " << m_testdata << ".nrsu." << endl;
+	}
 
-		// Setup boost::tokenizer
-		vector<string> fields; string line;
-		while (getline(testDataIn,line))
-		{
-			// Tokenize the line into 'fields'
-			boost::tokenizer< boost::escaped_list_separator<char> > tok(line);
-			fields.assign(tok.begin(),tok.end());
 
-	        // Create an entry from the tokenized string vector
-	        // DataEntry constructor automatically converts strings to the correct types 
-			DataEntry entry(fields);
-			TestDB.push_back(entry);
-		}
 
-		testDataIn.close();
-		cout << "done." << endl;
-		cout << "INFO\tLoaded " << TestDB.size() << " testing entries into memory." << endl;
+	/***
+	 *** A2b Compute input features
+	 ***/
+
+	// Scalings are fitted on the training data only, and applied to both databases.
+	if(!m_attachDataset.empty())
+		{ } // Attached with their features.
+	else if(m_streamBlockMB)
+	{
+		inputSchema.Fit(&TrainingStream);
+		TrainingStream.schema = &inputSchema;
+		TestStream.schema = &inputSchema;
+	}
+	else
+	{
+		inputSchema.Fit(&TrainingDB);
+		inputSchema.Apply(&TrainingDB);
+		if(!m_testdata.empty())
+			inputSchema.Apply(&TestDB);
+	}
+	inputSchema.Print(cout);
 
-		// Sort TestDB by NodeID, then Time.
-		sort(TestDB.begin(), TestDB.end(), sortIdThenTime);
+	// Share the databases with other runs, if requested.
+	if(!m_publishDataset.empty())
+	{
+		PublishDataset(m_publishDataset + ".train", &TrainingDB, &inputSchema);
+		if(!m_testdata.empty())
+			PublishDataset(m_publishDataset + ".test", &TestDB, &inputSchema);
+		cout << "INFO\tPublished the databases as shared dataset " << m_publishDataset << "." << endl;
 	}
 
 
@@ -324,6 +585,16 @@ int main(int argc, char *argv[])
 
 		genomeIn.close();
 		cout << "done." << endl;
+
+		// The genome must have been evolved for the same number of inputs.
+		uint16_t genomeInputs = 0;
+		for(map<uint16_t, NodeGene>::iterator 
+			iterNode = genomeFile.nodes.begin();
+			iterNode != genomeFile.nodes.end();
+			iterNode++)
+			if(iterNode->second.type == NodeType::SENSOR) genomeInputs++;
+		if(genomeInputs != g_inputs)
+			{ cout << "ERROR\tThe genome has " << genomeInputs << " inputs, but the input schema has " << g_inputs << "." << endl; exit(1); }
 	}
 
 
@@ -332,32 +603,66 @@ int main(int argc, char *argv[])
 	/***
 	 *** A3b If requested, test a loaded genome on the databases
 	 ***/ 
-	if(m_testGenome)
+	if(m_testGenome and gm_nativeAfter)
+		genomeFile.CompileNative();
+
+	if(m_testGenome and m_streamBlockMB)
+	{
+		// Same as below, a block at a time.
+		Dataset block;
+		vector<double> predictions;
+
+		ofstream ofTraining("training.csv");
+		TrainingStream.Rewind();
+		while(TrainingStream.NextBlock(&block))
+		{
+			predictions.resize(block.size);
+			genomeFile.GetFitness(&block, predictions.data());
+			for(uint64_t i = 0; i < block.size; i++)
+				ofTraining << block.contact_time[i] << ',' << predictions[i] << '\n';
+		}
+		if(gm_precision == Precision::FLOAT)
+			ReportPrecision(&genomeFile, 0, &TrainingStream);
+
+		if(!m_testdata.empty())
+		{
+			ofstream ofTest("test.csv");
+			TestStream.Rewind();
+			while(TestStream.NextBlock(&block))
+			{
+				predictions.resize(block.size);
+				genomeFile.GetFitness(&block, predictions.data());
+				for(uint64_t i = 0; i < block.size; i++)
+					ofTest << block.contact_time[i] << ',' << predictions[i] << '\n';
+			}
+		}
+
+		return 0;
+	}
+	else if(m_testGenome)
 	{
 		// Run the databases through the provided genome, and store the predictions.
-		genomeFile.GetFitness(&TrainingDB, true);
+		vector<double> predictions(TrainingDB.size);
+		genomeFile.GetFitness(&TrainingDB, predictions.data());
 
 		// File for writing.
 		ofstream ofTraining("training.csv");
 
 		// Output contact time and prediction
-		for(vector<DataEntry>::iterator 
-			iterDB = TrainingDB.begin();
-			iterDB != TrainingDB.end();
-			iterDB++)
-			ofTraining << iterDB->contact_time << ',' << iterDB->prediction << '\n';
+		for(uint64_t i = 0; i < TrainingDB.size; i++)
+			ofTraining << TrainingDB.contact_time[i] << ',' << predictions[i] << '\n';
+		if(gm_precision == Precision::FLOAT)
+			ReportPrecision(&genomeFile, &TrainingDB, 0);
 
 		// If a testing database was provided, repeat for the testing DB.
 		if(!m_testdata.empty())
 		{
 			ofstream ofTest("test.csv");
-			genomeFile.GetFitness(&TestDB, true);
+			predictions.assign(TestDB.size, 0);
+			genomeFile.GetFitness(&TestDB, predictions.data());
 
-			for(vector<DataEntry>::iterator 
-				iterDB = TestDB.begin();
-				iterDB != TestDB.end();
-				iterDB++)
-				ofTest << iterDB->contact_time << ',' << iterDB->prediction << '\n';
+			for(uint64_t i = 0; i < TestDB.size; i++)
+				ofTest << TestDB.contact_time[i] << ',' << predictions[i] << '\n';
 			
 		}
 
@@ -367,6 +672,63 @@ int main(int argc, char *argv[])
 
 
 
+	/***
+	 *** A3c If requested, merge redundant samples
+	 ***/
+
+	CompactionTolerances compaction;
+	compaction.Parse(m_compactTolerances);
+
+	// Only the training data: test fitness is measured on every sample, as without compaction.
+	if(m_compactSamples)
+	{
+		uint64_t samples = TrainingDB.size;
+		uint64_t removed = TrainingDB.Compact(compaction);
+		cout << "INFO\tCompacted the training data from " << samples << " to " << samples-removed << " samples ("
+			 << fixed << setprecision(1) << (samples ? 100.0*removed/samples : 0.0) << "% fewer activations)."
+			 << defaultfloat << setprecision(6) << endl;
+	}
+
+
+
+	/***
+	 *** A3d If requested, decimate the training data for coarse evaluation
+	 ***/
+
+	// By decimation factor: m_coarseToFine, then halving down to 2. Streamed blocks are decimated as read.
+	map<uint32_t, Dataset> CoarseDBs;
+	if(!m_streamBlockMB)
+		for(uint32_t factor = m_coarseToFine; factor > 1; factor /= 2)
+			CoarseDBs[factor].Decimate(&TrainingDB, factor);
+
+
+
+	/***
+	 *** A3e If requested, compress the databases
+	 ***/
+
+	if(m_compressData)
+	{
+		// What evaluation reads per entry: the features, and contact_time.
+		uint64_t rawEntries = TrainingDB.size + TestDB.size;
+		TrainingDB.Encode();
+		if(!m_testdata.empty()) TestDB.Encode();
+		uint64_t encodedBytes = TrainingDB.encoded.size() + TestDB.encoded.size();
+		for(map<uint32_t, Dataset>::iterator 
+			iterCoarse = CoarseDBs.begin();
+			iterCoarse != CoarseDBs.end();
+			iterCoarse++)
+		{
+			rawEntries += iterCoarse->second.size;
+			iterCoarse->second.Encode();
+			encodedBytes += iterCoarse->second.encoded.size();
+		}
+		cout << "INFO\tCompressed the databases from " << fixed << setprecision(1) << rawEntries*(g_inputs+1)*sizeof(float)/1e6 
+			 << " MB to " << encodedBytes/1e6 << " MB." << defaultfloat << setprecision(6) << endl;
+	}
+
+
+
 
 	/***
 	 *** A4 Initialize global Random Number Generators
@@ -449,10 +811,61 @@ int main(int argc, char *argv[])
 	// Threads setup
 	vector<pthread_t> threads(m_threads);
 
+	// With --fitness-sample or --coarse-to-fine, how many entries were run, against how many a full evaluation would have run.
+	uint64_t evaluatedEntries = 0, fullEvaluationEntries = 0;
+
+	// Genomes whose evaluation stopped early, past their species' survival boundary.
+	uint64_t culledGenomes = 0;
+
+	// With --coarse-to-fine, genomes are scored on every resolution-th sample of each vehicle.
+	uint32_t resolution = m_coarseToFine;
+	double resolutionBestFitness = 0;
+	uint32_t resolutionImprovementGeneration = 0;
+
 	do
 	{
 		if(gm_debug) cout << "DEBUG Generation " << g_generationNumber << endl;
 
+		/* With --follow, take in the entries appended since the last generation, and slide the window.
+		 * Only the new tail of the data is parsed. Scalings stay as fitted on the first window.
+		 */
+		if(m_follow)
+		{
+			uint64_t bytes = TrainingFollower.Poll(&TrainingWindow, m_threads);
+			if(bytes)
+			{
+				uint64_t dropped = SlideDatabaseWindow(&TrainingWindow, m_windowVehicles, m_windowSeconds, m_windowEntries);
+				SortDatabase(&TrainingWindow, m_threads);
+				TrainingDB.Assign(TrainingWindow);
+				inputSchema.Apply(&TrainingDB);
+				if(m_compactSamples) TrainingDB.Compact(compaction);
+				for(map<uint32_t, Dataset>::iterator 
+					iterCoarse = CoarseDBs.begin();
+					iterCoarse != CoarseDBs.end();
+					iterCoarse++)
+				{
+					iterCoarse->second.Decimate(&TrainingDB, iterCoarse->first);
+					if(m_compressData) iterCoarse->second.Encode();
+				}
+				if(m_compressData) TrainingDB.Encode();
+
+				// Errors cached on the old window are stale.
+				if(gm_fitnessCache) ClearFitnessCache();
+
+				// Fitness on the old window does not compare to the new one: restart the species' records.
+				for(list<Species>::iterator 
+					iterSpecies = population->species.begin();
+					iterSpecies != population->species.end();
+					iterSpecies++)
+					iterSpecies->bestFitness = 0;
+				lastBestFitness = 0;
+
+				cout << "INFO\tGeneration " << g_generationNumber << ": took in " << fixed << setprecision(1) << bytes/1e6 
+					 << " MB, window now " << TrainingDB.size << " entries (" << TrainingDB.segments.size() << " trips, " 
+					 << dropped << " entries dropped)." << defaultfloat << setprecision(6) << endl;
+			}
+		}
+
 		/* Initial setup for Generation loop.
 		 */ 
 
@@ -495,29 +908,119 @@ int main(int argc, char *argv[])
 		// Thread pointers
 		threadDataUpdateGenomeFitness td;
 		td.populationPointer = population;
-		td.database = &TrainingDB;
 
-		// Launch m_threads. 
-		int rc, tId;
-		for(tId=0; tId < m_threads; ++tId )
-		{
-			rc = pthread_create(&threads[tId], NULL, ThreadUpdateGenomeFitness, (void *)&td);
-			assert (rc == 0);
-		}
+		// With --fitness-sample, most generations only score a random subset of the vehicles.
+		// The subset is redrawn every generation, and every m_fullEvalEvery generations all data is used.
+		bool sampleGeneration = (m_fitnessSample < 1) and (g_generationNumber % m_fullEvalEvery != 0);
+		uint64_t sampleSeed = ( (uint64_t)m_seed << 32 ) ^ g_generationNumber;
+		DatasetSample sample;
+		uint64_t sampledEntries = 0, totalEntries = 0;
 
-		// Wait for all threads to complete.
-		for (tId = 0; tId < m_threads; ++tId) {
-			// block until thread 'index' completes
-			rc = pthread_join(threads[tId], NULL);
-			assert(0 == rc);
-		}
+		// At a coarse resolution, every genome runs on a decimation of the training data instead.
+		bool coarseGeneration = (resolution > 1);
+		Dataset* evaluationDB = coarseGeneration ? &CoarseDBs[resolution] : &TrainingDB;
+		uint64_t runEntries = 0;
 
-		// Put all iterSpecies->thread_processing back to false.
+		uint64_t genomeCount = 0;
 		for(list<Species>::iterator 
 			iterSpecies = population->species.begin();
 			iterSpecies != population->species.end();
 			iterSpecies++)
-			iterSpecies->thread_processing = false;
+			genomeCount += iterSpecies->genomes.size();
+
+		if(m_streamBlockMB or sampleGeneration or coarseGeneration)
+		{
+			/* Accumulate every genome's error. When streaming, every genome is run over a block 
+			 * before the next one is read, so the data is read once per generation.
+			 */
+			for(list<Species>::iterator 
+				iterSpecies = population->species.begin();
+				iterSpecies != population->species.end();
+				iterSpecies++)
+				for(list<Genome>::iterator
+					iterGenome = iterSpecies->genomes.begin();
+					iterGenome != iterSpecies->genomes.end();
+					iterGenome++)
+					{ iterGenome->sse = 0; iterGenome->culled = false; iterGenome->cachedFitness = false; }
+
+			if(m_streamBlockMB)
+			{
+				Dataset block, coarseBlock;
+				td.database = coarseGeneration ? &coarseBlock : &block;
+				TrainingStream.Rewind();
+				while(TrainingStream.NextBlock(&block))
+				{
+					totalEntries += block.size;
+					if(coarseGeneration) coarseBlock.Decimate(&block, resolution);
+					runEntries += td.database->size;
+					if(sampleGeneration)
+					{
+						SampleDataset(td.database, m_fitnessSample, sampleSeed, &sample);
+						sampledEntries += sample.entries;
+						td.sample = &sample;
+					}
+					RunGenomeFitnessThreads(ThreadAccumulateGenomeError, &td, threads);
+				}
+			}
+			else
+			{
+				totalEntries = TrainingDB.size;
+				runEntries = evaluationDB->size;
+				td.database = evaluationDB;
+				if(sampleGeneration)
+				{
+					SampleDataset(evaluationDB, m_fitnessSample, sampleSeed, &sample);
+					sampledEntries = sample.entries;
+					td.sample = &sample;
+				}
+				RunGenomeFitnessThreads(ThreadAccumulateGenomeError, &td, threads);
+			}
+
+			// Scale a sampled error up to the whole data, so it compares to a full fitness.
+			// Decimated entries are weighted by the samples they skip, so need no scaling.
+			double scale = 1.0;
+			if(sampleGeneration and (sampledEntries > 0))
+				scale = (double)runEntries/sampledEntries;
+
+			for(list<Species>::iterator 
+				iterSpecies = population->species.begin();
+				iterSpecies != population->species.end();
+				iterSpecies++)
+				for(list<Genome>::iterator
+					iterGenome = iterSpecies->genomes.begin();
+					iterGenome != iterSpecies->genomes.end();
+					iterGenome++)
+				{
+					iterGenome->fitness = FitnessFromError(iterGenome->sse * scale);
+					iterGenome->sampledFitness = sampleGeneration or coarseGeneration;
+				}
+		}
+		else
+		{
+			td.database = &TrainingDB;
+			td.survivalThreshold = m_survival_threshold;
+			uint64_t cacheLookups, cacheHits, lastLookups, lastHits;
+			GetFitnessCacheStats(&lastLookups, &lastHits);
+			RunGenomeFitnessThreads(ThreadUpdateGenomeFitness, &td, threads);
+			GetFitnessCacheStats(&cacheLookups, &cacheHits);
+			if(gm_fitnessCache)
+				cout << "INFO\tGeneration " << g_generationNumber << ": " << cacheHits - lastHits << " of " << cacheLookups - lastLookups
+					 << " genomes found in the fitness cache (" << fixed << setprecision(1) 
+					 << 100.0*(cacheHits - lastHits)/max(cacheLookups - lastLookups, (uint64_t)1) << "%)." << defaultfloat << setprecision(6) << endl;
+			totalEntries = runEntries = TrainingDB.size;
+			for(list<Species>::iterator 
+				iterSpecies = population->species.begin();
+				iterSpecies != population->species.end();
+				iterSpecies++)
+				for(list<Genome>::iterator
+					iterGenome = iterSpecies->genomes.begin();
+					iterGenome != iterSpecies->genomes.end();
+					iterGenome++)
+					iterGenome->sampledFitness = false;
+		}
+
+		evaluatedEntries += genomeCount * (sampleGeneration ? sampledEntries : runEntries);
+		fullEvaluationEntries += genomeCount * totalEntries;
 
 
 
@@ -541,11 +1044,24 @@ int main(int argc, char *argv[])
 			uint16_t noSurvivors = iterSpecies->genomes.size() * m_survival_threshold;
 			if(gm_debug) cout << "DEBUG Killing " << noSurvivors << " from species id " << iterSpecies->id << " size " << iterSpecies->genomes.size() << '\n';
 
+			// Count the genomes whose evaluation was cut short. All of them are among those killed.
+			for(list<Genome>::iterator
+				iterGenome = iterSpecies->genomes.begin();
+				iterGenome != iterSpecies->genomes.end();
+				iterGenome++)
+				culledGenomes += iterGenome->culled;
+
 			// Trim genome list
 			if(noSurvivors>0)
 				for(uint16_t killCount = 0; killCount < noSurvivors; killCount++)
 					iterSpecies->genomes.pop_back();
 
+			// The worst survivor bounds next generation's evaluation, if it was scored on all the data.
+			if( m_streamBlockMB or sampleGeneration or coarseGeneration or iterSpecies->genomes.empty() )
+				iterSpecies->survivalError = INFINITY;
+			else
+				iterSpecies->survivalError = iterSpecies->genomes.back().sse;
+
 		} // END SPECIES ITERATION
 
 
@@ -557,9 +1073,31 @@ int main(int argc, char *argv[])
 		 * Requires: up-to-date fitness on all genomes.
 		 */
 		
+		// Champions, and so best fitness, are only ever taken from a full evaluation.
+		evaluatedEntries += ValidateChampions(population, &TrainingDB, m_streamBlockMB ? &TrainingStream : 0);
+
 		// Update each species' champion, best fitness, generation update
 		population->UpdateSpeciesAndPopulationStats();
 
+		// With --coarse-to-fine, refine the resolution once the best (full) fitness stops improving.
+		if(resolution > 1)
+		{
+			if(population->bestFitness > resolutionBestFitness)
+			{
+				resolutionBestFitness = population->bestFitness;
+				resolutionImprovementGeneration = g_generationNumber;
+			}
+			else if(g_generationNumber - resolutionImprovementGeneration >= m_resolutionPatience)
+			{
+				CoarseDBs.erase(resolution);
+				resolution /= 2;
+				resolutionImprovementGeneration = g_generationNumber;
+				cout << "INFO\tGeneration " << g_generationNumber << ": best fitness plateaued, now scoring on ";
+				if(resolution > 1)	cout << "1 in " << resolution << " samples of each vehicle." << endl;
+				else				cout << "every sample." << endl;
+			}
+		}
+
 		// Kill stale species
 		if(m_killStagnated)
 		{
@@ -632,6 +1170,7 @@ int main(int argc, char *argv[])
 			speciesCopy.bestFitness = iterSpecies->bestFitness;
 			speciesCopy.lastImprovementGeneration = iterSpecies->lastImprovementGeneration;
 			speciesCopy.lastRefocusGeneration = iterSpecies->lastRefocusGeneration;
+			speciesCopy.survivalError = iterSpecies->survivalError;
 
 			speciesCopy.genomes.push_back( *(iterSpecies->champion) );
 
@@ -910,6 +1449,7 @@ int main(int argc, char *argv[])
 		population = newPopulation;
 		
 		// Update statistics on the new population
+		evaluatedEntries += ValidateChampions(population, &TrainingDB, m_streamBlockMB ? &TrainingStream : 0);
 		population->UpdateSpeciesAndPopulationStats();
 
 
@@ -934,7 +1474,14 @@ int main(int argc, char *argv[])
 
 		if(!m_printFitnessFile.empty())
 		{
-			if(!m_testdata.empty())
+			if(m_streamBlockMB)
+			{
+				if(!m_testdata.empty())
+					{ population->PrintFitness(ofFitness, &TrainingStream, &TestStream); ofFitness.flush(); }
+				else
+					{ population->PrintFitness(ofFitness, &TrainingStream); ofFitness.flush(); }
+			}
+			else if(!m_testdata.empty())
 				{ population->PrintFitness(ofFitness, &TrainingDB, &TestDB); ofFitness.flush(); }
 			else
 				{ population->PrintFitness(ofFitness, &TrainingDB); ofFitness.flush(); }
@@ -950,14 +1497,15 @@ int main(int argc, char *argv[])
 							<< "_species" << setfill('0') << setw(3) << population->bestSpecies->id 
 							<< ".gv";
 			const string& filenameGV = ssfilenameGV.str();
-			population->superChampion->PrintToGV(filenameGV.c_str());
+			Genome exported = m_pruneExports ? population->superChampion->Pruned() : *population->superChampion;
+			exported.PrintToGV(filenameGV.c_str());
 
 			ssfilenameCSV 	<< "superChampion" 
 				<< "_gen" << setfill('0') << setw(6) << g_generationNumber 
 				<< "_species" << setfill('0') << setw(3) << population->bestSpecies->id 
 				<< ".csv";
 			const string& filenameCSV = ssfilenameCSV.str();
-			population->superChampion->SaveToFile(filenameCSV.c_str());
+			exported.SaveToFile(filenameCSV.c_str());
 		}
 
 	// Generation loop control
@@ -969,12 +1517,38 @@ int main(int argc, char *argv[])
 	 *** Z0 Wrap up
 	 ***/
 
+	if( (m_fitnessSample < 1) or (m_coarseToFine > 1) )
+		cout << "INFO\tReduced fitness evaluation ran " << fixed << setprecision(1) << 100.0*evaluatedEntries/fullEvaluationEntries 
+			 << "% of the entries of full evaluation." << defaultfloat << setprecision(6) << endl;
+
+	if(gm_batchTopologies)
+	{
+		uint64_t batchGenomes, batchBatched, batchBatches;
+		GetBatchStats(&batchGenomes, &batchBatched, &batchBatches);
+		cout << "INFO\tTopology batching: " << batchBatched << " of " << batchGenomes << " genome evaluations (" << fixed << setprecision(1) 
+			 << 100.0*batchBatched/max(batchGenomes, (uint64_t)1) << "%) ran in " << batchBatches << " batches, " 
+			 << (double)batchBatched/max(batchBatches, (uint64_t)1) << " genomes each." << defaultfloat << setprecision(6) << endl;
+	}
+
+	if(culledGenomes)
+		cout << "INFO\tEvaluation stopped early for " << culledGenomes << " genomes past their species' survival boundary." << endl;
+
+	if(gm_nativeAfter)
+	{
+		uint32_t nativeCompiled, nativeCached;
+		GetNativeStats(&nativeCompiled, &nativeCached);
+		cout << "INFO\tNative activation: " << nativeCompiled << " modules compiled, " << nativeCached << " loaded from the cache." << endl;
+	}
+
 	// Print the super champion.
 	population->UpdateSpeciesAndPopulationStats();
+	if(gm_precision == Precision::FLOAT)
+		ReportPrecision(population->superChampion, &TrainingDB, m_streamBlockMB ? &TrainingStream : 0);
 
 	population->superChampion->Print(cout);
-	population->superChampion->PrintToGV("superChampion.gv");
-	population->superChampion->SaveToFile("superChampion.csv");
+	Genome exported = m_pruneExports ? population->superChampion->Pruned() : *population->superChampion;
+	exported.PrintToGV("superChampion.gv");
+	exported.SaveToFile("superChampion.csv");
 
 	delete population;
 
@@ -982,20 +1556,133 @@ int main(int argc, char *argv[])
 }
 
 
-void *ThreadUpdateGenomeFitness(void *threadarg)
+uint64_t ValidateChampions(Population* population, const Dataset* database, DatabaseStream* stream)
 {
-	threadDataUpdateGenomeFitness* threadPointers;
-	threadPointers = (threadDataUpdateGenomeFitness *) threadarg;
-	
+	/* Re-score each species' best genome on the full training data while its fitness is only
+	 * an estimate. A re-scored genome can fall behind another estimate, so repeat until the best
+	 * genome of every species has a full fitness.
+	 */
+	uint64_t evaluatedEntries = 0;
+	for(list<Species>::iterator 
+		iterSpecies = population->species.begin();
+		iterSpecies != population->species.end();
+		iterSpecies++)
+		for(Genome* champion = iterSpecies->FindChampion(); 
+			champion->sampledFitness; 
+			champion = iterSpecies->FindChampion())
+		{
+			champion->fitness = stream ? champion->GetFitness(stream) : champion->GetFitness(database);
+			champion->sampledFitness = false;
+			evaluatedEntries += stream ? stream->entries : database->size;
+		}
+	return evaluatedEntries;
+}
+
+
+void ReportPrecision(Genome* genome, const Dataset* database, DatabaseStream* stream)
+{
+	// Score the genome both ways. Predictions are only compared when the whole database is in memory.
+	vector<double> floatPredictions, doublePredictions;
+	if(!stream)
+	{
+		floatPredictions.resize(database->size);
+		doublePredictions.resize(database->size);
+	}
+	double floatFitness = stream ? genome->GetFitness(stream) : genome->GetFitness(database, floatPredictions.data());
+	gm_precision = Precision::DOUBLE;
+	double doubleFitness = stream ? genome->GetFitness(stream) : genome->GetFitness(database, doublePredictions.data());
+	gm_precision = Precision::FLOAT;
+
+	double worstError = 0;
+	for(uint64_t i = 0; i < floatPredictions.size(); i++)
+		worstError = max(worstError, fabs(floatPredictions[i] - doublePredictions[i]));
+
+	cout << "INFO\tSingle precision: fitness " << setprecision(9) << floatFitness << ", " << doubleFitness << " in double precision ("
+		 << scientific << setprecision(2) << fabs(floatFitness - doubleFitness)/doubleFitness << " relative error)";
+	if(!stream)
+		cout << ", predictions within " << worstError;
+	cout << "." << defaultfloat << setprecision(6) << endl;
+}
+
+
+void RunGenomeFitnessThreads(void *(*routine)(void *), threadDataUpdateGenomeFitness* td, vector<pthread_t>& threads)
+{
+	// Launch threads. 
+	int rc, tId;
+	td->threadCount = threads.size();
+	for(tId=0; tId < (int)threads.size(); ++tId )
+	{
+		rc = pthread_create(&threads[tId], NULL, routine, (void *)td);
+		assert (rc == 0);
+	}
+
+	// Wait for all threads to complete.
+	for (tId = 0; tId < (int)threads.size(); ++tId) {
+		// block until thread 'index' completes
+		rc = pthread_join(threads[tId], NULL);
+		assert(0 == rc);
+	}
+
+	// Put all iterSpecies->thread_processing back to false.
 	for(list<Species>::iterator 
+		iterSpecies = td->populationPointer->species.begin();
+		iterSpecies != td->populationPointer->species.end();
+		iterSpecies++)
+		iterSpecies->thread_processing = false;
+}
+
+
+/* Claims species no other thread has claimed, until they hold this thread's share of the genomes.
+ * The claimed species are run over the data together, so the data is read once per thread, not
+ * once per species. Returns an empty group if there are none left.
+ */
+static vector<Species*> ClaimSpecies(threadDataUpdateGenomeFitness* threadPointers)
+{
+	vector<Species*> claimed;
+	pthread_mutex_lock(&threadPointers->claimLock);
+
+	size_t genomeCount = 0;
+	for(list<Species>::const_iterator 
 		iterSpecies = threadPointers->populationPointer->species.begin();
 		iterSpecies != threadPointers->populationPointer->species.end();
 		iterSpecies++)
+		genomeCount += iterSpecies->genomes.size();
+	size_t share = (genomeCount + threadPointers->threadCount - 1) / threadPointers->threadCount;
+
+	size_t claimedGenomes = 0;
+	for(list<Species>::iterator 
+		iterSpecies = threadPointers->populationPointer->species.begin();
+		(iterSpecies != threadPointers->populationPointer->species.end()) and (claimedGenomes < share);
+		iterSpecies++)
 		if(!iterSpecies->thread_processing)
 		{
 			iterSpecies->thread_processing = true;
-			iterSpecies->UpdateGenomeFitness(threadPointers->database);
+			claimed.push_back(&(*iterSpecies));
+			claimedGenomes += iterSpecies->genomes.size();
 		}
+	pthread_mutex_unlock(&threadPointers->claimLock);
+	return claimed;
+}
+
+
+void *ThreadUpdateGenomeFitness(void *threadarg)
+{
+	threadDataUpdateGenomeFitness* threadPointers;
+	threadPointers = (threadDataUpdateGenomeFitness *) threadarg;
+	
+	for(vector<Species*> group = ClaimSpecies(threadPointers); !group.empty(); group = ClaimSpecies(threadPointers))
+		Species::UpdateGenomeFitness(group, threadPointers->database, threadPointers->survivalThreshold);
+	pthread_exit(NULL);
+}
+
+
+void *ThreadAccumulateGenomeError(void *threadarg)
+{
+	threadDataUpdateGenomeFitness* threadPointers;
+	threadPointers = (threadDataUpdateGenomeFitness *) threadarg;
+	
+	for(vector<Species*> group = ClaimSpecies(threadPointers); !group.empty(); group = ClaimSpecies(threadPointers))
+		Species::AccumulateGenomeError(group, threadPointers->database, threadPointers->sample);
 	pthread_exit(NULL);
 }
 
@@ -1006,6 +1693,13 @@ bool OneShotBernoulli(float probability)
 }
 
 
+void HashBytes(uint64_t* hash, const void* data, size_t bytes)
+{
+	for(size_t i = 0; i < bytes; i++)
+		*hash = (*hash ^ ((const uint8_t*)data)[i]) * 0x100000001b3ULL;
+}
+
+
 bool sortIdThenTime( DataEntry const &first, DataEntry const &second )
 {
 	if(first.node_id < second.node_id)